@@ -1,46 +1,212 @@
+// Монитор устройств scull_ring_buffer: скорость чтения и записи, заполненность
+// и число спящих процессов по каждому устройству.
+//
+//   ./process_C                          все /dev/scull_ring_buffer*, раз в 500 мс
+//   ./process_C -i 200 /dev/scull_ring_buffer0 /dev/scull_ring_buffer1
+//
+// Состояние берется со страниц телеметрии (mmap по SCULL_TELEMETRY_OFFSET),
+// которые драйвер обновляет сам: в цикле опроса нет системных вызовов к
+// устройствам, и чтение и запись монитор не замедляет.
+//
+// Отображение телеметрии не мешает удалить устройство через /dev/scull_ctl.
+// Удаленное устройство монитор отпускает (флаг SCULL_TELEMETRY_REMOVED), а раз
+// в RESCAN_MS заново открывает пути, которые сейчас не отображены: так
+// подхватываются и пересозданные, и новые устройства. Открытие длится до
+// mmap, и только в это время удаление устройства получит -EBUSY.
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
 
-int main() {
-    int fd1 = open("/dev/scull_ring_buffer0", O_RDONLY | O_NONBLOCK);
-    int fd2 = open("/dev/scull_ring_buffer1", O_RDONLY | O_NONBLOCK);
+#include "scull_ioctl.h"
 
-    if (fd1 < 0 || fd2 < 0) {
-        perror("open");
-        exit(1);
+#define MAX_MONITORED 256
+#define DEV_PREFIX "/dev/scull_ring_buffer"
+#define RESCAN_MS 2000
+
+struct monitored {
+    char path[64];
+    const volatile struct scull_telemetry *page;   // NULL - сейчас не отображено
+    struct scull_telemetry prev;    // Предыдущий снимок - для скоростей
+    int have_prev;
+};
+
+static struct monitored devs[MAX_MONITORED];
+static int ndevs;
+static long page_size;
+
+static struct monitored *add_path(const char *path) {
+    struct monitored *m;
+
+    if (ndevs == MAX_MONITORED)
+        return NULL;
+    m = &devs[ndevs++];
+    snprintf(m->path, sizeof(m->path), "%s", path);
+    return m;
+}
+
+// Отображаем страницу телеметрии. Файл после mmap можно закрыть: отображение
+// держит только страницу, а не устройство
+static int map_device(struct monitored *m) {
+    void *page;
+    int fd;
+
+    fd = open(m->path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0)
+        return -1;
+    page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, SCULL_TELEMETRY_OFFSET);
+    close(fd);
+    if (page == MAP_FAILED) {
+        perror(m->path);
+        return -1;
     }
+    m->page = page;
+    m->have_prev = 0;
+    return 0;
+}
 
-    struct buffer_info {
-        int data_size;
-        int buffer_size;
-        int read_index;
-        int write_index;
-    } info1, info2;
+// Устройство удалено: отпускаем страницу, путь остается для пересканирования
+static void unmap_device(struct monitored *m) {
+    munmap((void *)m->page, page_size);
+    m->page = NULL;
+}
 
-    while (1) {
-        // Используем ioctl для получения размера данных
-        if (ioctl(fd1, 1, &info1) == 0) {
-            printf("scull1 buffer data size: %d bytes\n", info1.data_size);
-            printf("scull1 buffer size: %d bytes\n", info1.buffer_size);
-            printf("scull1 read_index: %d\n", info1.read_index);
-            printf("scull1 write_index: %d\n\n", info1.write_index);
+static int rescan(void) {
+    int i, mapped = 0;
+
+    for (i = 0; i < ndevs; i++) {
+        if (!devs[i].page)
+            map_device(&devs[i]);
+        mapped += devs[i].page != NULL;
+    }
+    return mapped;
+}
+
+// Согласованная копия страницы по протоколу seqcount
+static void snapshot(const volatile struct scull_telemetry *page, struct scull_telemetry *out) {
+    unsigned int seq;
+
+    for (;;) {
+        seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        memcpy(out, (const void *)page, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq)
+            return;
+    }
+}
+
+static void print_rate(double bytes_per_s) {
+    if (bytes_per_s >= 1e9)
+        printf(" %8.2f GB/s", bytes_per_s / 1e9);
+    else if (bytes_per_s >= 1e6)
+        printf(" %8.2f MB/s", bytes_per_s / 1e6);
+    else
+        printf(" %8.2f KB/s", bytes_per_s / 1e3);
+}
+
+static void print_row(struct monitored *m) {
+    struct scull_telemetry cur;
+    const struct scull_status *st = &cur.status, *old = &m->prev.status;
+    double dt, fill;
+
+    snapshot(m->page, &cur);
+    if (cur.flags & SCULL_TELEMETRY_REMOVED) {
+        printf("%-26s removed\n", m->path);
+        unmap_device(m);
+        return;
+    }
+    fill = st->capacity ? 100.0 * st->data_size / st->capacity : 0;
+    printf("%-26s %5.1f%% %10llu/%-10llu", m->path, fill,
+           (unsigned long long)st->data_size, (unsigned long long)st->capacity);
 
+    // Скорость - по времени обновлений страницы, а не по своим часам
+    dt = m->have_prev ? (cur.update_ns - m->prev.update_ns) / 1e9 : 0;
+    if (dt > 0) {
+        print_rate((st->write_bytes - old->write_bytes) / dt);
+        print_rate((st->read_bytes - old->read_bytes) / dt);
+        printf(" %9.0f %9.0f", (st->write_ops - old->write_ops) / dt,
+               (st->read_ops - old->read_ops) / dt);
+    } else {
+        printf(" %13s %13s %9s %9s", "-", "-", "-", "-");
+    }
+    printf(" %4u %4u", st->write_waiters, st->read_waiters);
+    if (st->dropped_bytes)
+        printf("  dropped %llu", (unsigned long long)st->dropped_bytes);
+    printf("\n");
+
+    // Страница не обновлялась с прошлого раза - копим интервал дальше
+    if (!m->have_prev || cur.update_ns != m->prev.update_ns) {
+        m->prev = cur;
+        m->have_prev = 1;
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-i interval_ms] [device...]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    struct timespec interval;
+    char path[64];
+    long interval_ms = 500;
+    long since_rescan = 0;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "i:h")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval_ms = strtol(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
         }
-        if (ioctl(fd2, 1, &info2) == 0) {
-            printf("scull2 buffer data size: %d bytes\n", info2.data_size);
-            printf("scull2 buffer size: %d bytes\n", info2.buffer_size);
-            printf("scull2 read_index: %d\n", info2.read_index);
-            printf("scull2 write_index: %d\n", info2.write_index);
+    }
+    if (interval_ms <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
 
+    page_size = sysconf(_SC_PAGESIZE);
+    if (optind < argc) {
+        for (i = optind; i < argc; i++)
+            add_path(argv[i]);
+    } else {
+        // Устройства создаются и через /dev/scull_ctl - minor идут не подряд
+        for (i = 0; i < MAX_MONITORED; i++) {
+            snprintf(path, sizeof(path), DEV_PREFIX "%d", i);
+            add_path(path);
         }
-        printf("---\n");
-        sleep(2);
     }
+    if (rescan() == 0) {
+        fprintf(stderr, "No scull_ring_buffer devices to monitor\n");
+        return EXIT_FAILURE;
+    }
+
+    interval.tv_sec = interval_ms / 1000;
+    interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+
+    while (1) {
+        printf("%-26s %6s %21s %13s %13s %9s %9s %4s %4s\n", "device", "fill", "data/capacity",
+               "write", "read", "writes/s", "reads/s", "wblk", "rblk");
+        for (i = 0; i < ndevs; i++) {
+            if (devs[i].page)
+                print_row(&devs[i]);
+        }
+        printf("---\n");
+        fflush(stdout);
+        nanosleep(&interval, NULL);
 
-    close(fd1);
-    close(fd2);
+        since_rescan += interval_ms;
+        if (since_rescan >= RESCAN_MS) {
+            rescan();
+            since_rescan = 0;
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
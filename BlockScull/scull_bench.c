@@ -0,0 +1,632 @@
+// scull_bench - нагрузочный тест scull_ring_buffer: пропускная способность и
+// сквозная задержка от write(2) продюсера до read(2) консюмера.
+//
+//   ./scull_bench -d /dev/scull_ring_buffer0 -s 64 -p 2 -c 1 -m poll -t 10 --json
+//
+// Каждое сообщение начинается с отметки CLOCK_MONOTONIC и номера, консюмер
+// по ним считает задержку. С несколькими продюсерами или консюмерами границы
+// сообщений сохраняет только режим записей, поэтому он включается сам;
+// потоковый режим (--stream) допустим для одной пары. На время теста режим
+// устройства меняется и затем восстанавливается.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "scull_ioctl.h"
+
+#define DEFAULT_DEV "/dev/scull_ring_buffer0"
+#define MAX_THREADS 256
+#define MAX_CPUS 1024
+// Сколько ждать, пока консюмеры дочитают остаток после остановки продюсеров
+#define DRAIN_TIMEOUT_NS (2ull * 1000000000ull)
+
+// Гистограмма задержек: 16 линейных ячеек на каждую степень двойки,
+// погрешность перцентилей не больше 1/16
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1u << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum io_mode { IO_BLOCK, IO_NONBLOCK, IO_POLL };
+
+static const char *const io_mode_names[] = { "block", "nonblock", "poll" };
+
+// Заголовок каждого сообщения, остаток заполнен нулями
+struct bench_msg {
+    uint64_t ts_ns;        // Когда продюсер начал write(2)
+    uint64_t seq;          // Номер сообщения у продюсера
+};
+
+struct config {
+    const char *dev;
+    size_t msg_size;       // Размер сообщения без заголовка записи
+    size_t read_size;      // Размер буфера одного read(2)
+    int producers;
+    int consumers;
+    enum io_mode io;
+    double duration;       // Секунды
+    bool stream;           // Потоковый режим вместо режима записей
+    bool percpu;           // Дополнительно включить SCULL_MODE_PERCPU
+    bool json;
+    int cpus[MAX_CPUS];    // Список CPU для привязки потоков по кругу
+    int ncpus;
+};
+
+struct worker {
+    pthread_t thread;
+    int id;
+    bool producer;
+    int fd;
+    atomic_bool done;
+    uint64_t ops;          // Успешные read(2)/write(2)
+    uint64_t msgs;         // Целые сообщения
+    uint64_t eagain;
+    uint64_t errors;
+    // Сборка сообщений в потоковом режиме
+    size_t partial;
+    struct bench_msg hdr;
+    uint64_t hist[HIST_BUCKETS];
+};
+
+static struct config cfg = {
+    .dev = DEFAULT_DEV,
+    .msg_size = 64,
+    .read_size = 64 * 1024,
+    .producers = 1,
+    .consumers = 1,
+    .io = IO_BLOCK,
+    .duration = 5.0,
+};
+
+static atomic_bool stop_producers;
+static atomic_bool stop_consumers;
+static atomic_uint_fast64_t consumed_msgs;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned int hist_index(uint64_t v)
+{
+    unsigned int k;
+
+    if (v < HIST_SUB)
+        return v;
+    k = 63 - __builtin_clzll(v);
+    return (k - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (k - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// Верхняя граница ячейки - перцентили округляются в большую сторону
+static uint64_t hist_value(unsigned int idx)
+{
+    unsigned int shift;
+
+    if (idx < HIST_SUB)
+        return idx;
+    shift = idx / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + idx % HIST_SUB) << shift) + (1ull << shift) - 1;
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total, double p)
+{
+    uint64_t rank = (uint64_t)(p * total);
+    uint64_t seen = 0;
+    unsigned int i;
+
+    if (rank >= total)
+        rank = total - 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank)
+            return hist_value(i);
+    }
+    return 0;
+}
+
+static void pin_thread(int n)
+{
+    cpu_set_t set;
+
+    if (cfg.ncpus == 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cfg.cpus[n % cfg.ncpus], &set);
+    errno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (errno)
+        perror("pthread_setaffinity_np");
+}
+
+// Ожидание после EAGAIN: в режиме nonblock крутимся, в режиме poll спим в
+// poll(2) с коротким таймаутом, чтобы заметить остановку. true - пора выходить
+static bool wait_ready(struct worker *w, short events, atomic_bool *stop)
+{
+    struct pollfd pfd = { .fd = w->fd, .events = events };
+
+    if (cfg.io == IO_POLL && poll(&pfd, 1, 100) < 0 && errno != EINTR) {
+        perror("poll");
+        w->errors++;
+        return true;
+    }
+    return atomic_load_explicit(stop, memory_order_relaxed);
+}
+
+static void *producer_main(void *arg)
+{
+    struct worker *w = arg;
+    char *buf = calloc(1, cfg.msg_size);
+    struct bench_msg msg;
+
+    if (!buf) {
+        w->errors++;
+        goto out;
+    }
+    pin_thread(w->id);
+
+    while (!atomic_load_explicit(&stop_producers, memory_order_relaxed)) {
+        size_t off = 0;
+
+        msg.seq = w->msgs;
+        msg.ts_ns = now_ns();
+        memcpy(buf, &msg, sizeof(msg));
+
+        // В потоковом режиме сообщение может уйти в несколько write(2);
+        // недописанное при остановке сообщение консюмер просто не досчитает
+        while (off < cfg.msg_size) {
+            ssize_t ret = write(w->fd, buf + off, cfg.msg_size - off);
+
+            if (ret > 0) {
+                w->ops++;
+                off += ret;
+            } else if (ret < 0 && errno == EAGAIN) {
+                w->eagain++;
+                if (wait_ready(w, POLLOUT, &stop_producers))
+                    goto out;
+            } else if (ret < 0 && errno == EINTR) {
+                if (atomic_load_explicit(&stop_producers, memory_order_relaxed))
+                    goto out;
+            } else {
+                perror("write");
+                w->errors++;
+                goto out;
+            }
+        }
+        w->msgs++;
+    }
+
+out:
+    free(buf);
+    atomic_store(&w->done, true);
+    return NULL;
+}
+
+static void account_msg(struct worker *w, const struct bench_msg *msg, uint64_t now)
+{
+    w->hist[hist_index(now > msg->ts_ns ? now - msg->ts_ns : 0)]++;
+    w->msgs++;
+    atomic_fetch_add_explicit(&consumed_msgs, 1, memory_order_relaxed);
+}
+
+// Разбор прочитанного: в режиме записей - по заголовкам записей, в потоковом -
+// по фиксированному размеру сообщения
+static void consume(struct worker *w, const char *buf, size_t len, uint64_t now)
+{
+    size_t off = 0;
+
+    if (!cfg.stream) {
+        while (off + sizeof(struct scull_record_hdr) <= len) {
+            struct scull_record_hdr hdr;
+            struct bench_msg msg;
+
+            memcpy(&hdr, buf + off, sizeof(hdr));
+            off += sizeof(hdr);
+            if (hdr.len < sizeof(msg) || off + hdr.len > len) {
+                fprintf(stderr, "consumer %d: malformed record\n", w->id);
+                w->errors++;
+                return;
+            }
+            memcpy(&msg, buf + off, sizeof(msg));
+            off += hdr.len;
+            account_msg(w, &msg, now);
+        }
+        return;
+    }
+
+    while (off < len) {
+        size_t n = cfg.msg_size - w->partial;
+
+        if (n > len - off)
+            n = len - off;
+        if (w->partial < sizeof(w->hdr)) {
+            size_t h = sizeof(w->hdr) - w->partial;
+
+            memcpy((char *)&w->hdr + w->partial, buf + off, h < n ? h : n);
+        }
+        w->partial += n;
+        off += n;
+        if (w->partial == cfg.msg_size) {
+            account_msg(w, &w->hdr, now);
+            w->partial = 0;
+        }
+    }
+}
+
+static void *consumer_main(void *arg)
+{
+    struct worker *w = arg;
+    char *buf = malloc(cfg.read_size);
+
+    if (!buf) {
+        w->errors++;
+        goto out;
+    }
+    pin_thread(w->id);
+
+    while (!atomic_load_explicit(&stop_consumers, memory_order_relaxed)) {
+        ssize_t ret = read(w->fd, buf, cfg.read_size);
+
+        if (ret > 0) {
+            w->ops++;
+            consume(w, buf, ret, now_ns());
+        } else if (ret < 0 && errno == EAGAIN) {
+            w->eagain++;
+            if (wait_ready(w, POLLIN, &stop_consumers))
+                break;
+        } else if (ret < 0 && errno != EINTR) {
+            perror("read");
+            w->errors++;
+            break;
+        }
+    }
+
+out:
+    free(buf);
+    atomic_store(&w->done, true);
+    return NULL;
+}
+
+// Сигнал только прерывает блокирующий read(2)/write(2) с EINTR
+static void wakeup_handler(int sig)
+{
+    (void)sig;
+}
+
+// Останавливаем потоки: если поток спит в драйвере, будим его сигналом,
+// пока он не заметит флаг
+static void stop_workers(struct worker *w, int n, atomic_bool *stop)
+{
+    struct timespec pause = { 0, 10 * 1000 * 1000 };
+    int i;
+
+    atomic_store(stop, true);
+    for (i = 0; i < n; i++) {
+        while (!atomic_load(&w[i].done)) {
+            pthread_kill(w[i].thread, SIGUSR1);
+            nanosleep(&pause, NULL);
+        }
+        pthread_join(w[i].thread, NULL);
+    }
+}
+
+// Сбрасываем остатки прошлых запусков: режим меняется только на пустом буфере
+static void drain_device(void)
+{
+    size_t size = 1 << 20;
+    char *buf = malloc(size);
+    int fd = open(cfg.dev, O_RDONLY | O_NONBLOCK);
+
+    if (buf && fd >= 0)
+        while (read(fd, buf, size) > 0)
+            ;
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+}
+
+static int parse_cpus(const char *s)
+{
+    while (*s) {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+
+        if (end == s || lo < 0)
+            return -1;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo)
+                return -1;
+        }
+        for (; lo <= hi; lo++) {
+            if (cfg.ncpus == MAX_CPUS)
+                return -1;
+            cfg.cpus[cfg.ncpus++] = lo;
+        }
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        s = end;
+    }
+    return cfg.ncpus ? 0 : -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -d, --dev PATH        device (default %s)\n"
+            "  -s, --size BYTES      message size, >= %zu (default 64)\n"
+            "  -p, --producers N     producer threads (default 1)\n"
+            "  -c, --consumers N     consumer threads (default 1)\n"
+            "  -m, --mode MODE       block | nonblock | poll (default block)\n"
+            "  -t, --time SECONDS    run duration (default 5)\n"
+            "  -r, --read-size BYTES read(2) buffer size (default 65536)\n"
+            "  -a, --cpus LIST       pin threads round-robin, e.g. 0-3,8\n"
+            "      --stream          byte-stream mode (one producer, one consumer)\n"
+            "      --percpu          also enable per-CPU producer sub-rings\n"
+            "  -j, --json            print one JSON object instead of text\n",
+            prog, DEFAULT_DEV, sizeof(struct bench_msg));
+}
+
+static int parse_args(int argc, char **argv)
+{
+    static const struct option opts[] = {
+        { "dev",       required_argument, NULL, 'd' },
+        { "size",      required_argument, NULL, 's' },
+        { "producers", required_argument, NULL, 'p' },
+        { "consumers", required_argument, NULL, 'c' },
+        { "mode",      required_argument, NULL, 'm' },
+        { "time",      required_argument, NULL, 't' },
+        { "read-size", required_argument, NULL, 'r' },
+        { "cpus",      required_argument, NULL, 'a' },
+        { "stream",    no_argument,       NULL, 'S' },
+        { "percpu",    no_argument,       NULL, 'P' },
+        { "json",      no_argument,       NULL, 'j' },
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "d:s:p:c:m:t:r:a:jh", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'd': cfg.dev = optarg; break;
+        case 's': cfg.msg_size = strtoul(optarg, NULL, 0); break;
+        case 'p': cfg.producers = atoi(optarg); break;
+        case 'c': cfg.consumers = atoi(optarg); break;
+        case 't': cfg.duration = atof(optarg); break;
+        case 'r': cfg.read_size = strtoul(optarg, NULL, 0); break;
+        case 'S': cfg.stream = true; break;
+        case 'P': cfg.percpu = true; break;
+        case 'j': cfg.json = true; break;
+        case 'm':
+            for (cfg.io = IO_BLOCK; cfg.io <= IO_POLL; cfg.io++)
+                if (!strcmp(optarg, io_mode_names[cfg.io]))
+                    break;
+            if (cfg.io > IO_POLL) {
+                fprintf(stderr, "unknown mode: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'a':
+            if (parse_cpus(optarg)) {
+                fprintf(stderr, "bad cpu list: %s\n", optarg);
+                return -1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (cfg.msg_size < sizeof(struct bench_msg) || cfg.producers < 1 || cfg.consumers < 1 ||
+        cfg.producers + cfg.consumers > MAX_THREADS || cfg.duration <= 0) {
+        usage(argv[0]);
+        return -1;
+    }
+    if (cfg.stream && (cfg.producers > 1 || cfg.consumers > 1)) {
+        fprintf(stderr, "--stream keeps message boundaries only for one producer and one consumer\n");
+        return -1;
+    }
+    // Консюмер должен вмещать хотя бы одну запись целиком, иначе -EMSGSIZE
+    if (!cfg.stream && cfg.read_size < cfg.msg_size + sizeof(struct scull_record_hdr))
+        cfg.read_size = cfg.msg_size + sizeof(struct scull_record_hdr);
+    return 0;
+}
+
+static void report(struct worker *w, double elapsed)
+{
+    static uint64_t hist[HIST_BUCKETS];
+    uint64_t writes = 0, reads = 0, msgs = 0, sent = 0, eagain = 0, errors = 0;
+    uint64_t lat_min = 0, lat_max = 0;
+    double mbps, msgps;
+    int i, n = cfg.producers + cfg.consumers;
+    unsigned int b;
+
+    for (i = 0; i < n; i++) {
+        if (w[i].producer) {
+            writes += w[i].ops;
+            sent += w[i].msgs;
+        } else {
+            reads += w[i].ops;
+            msgs += w[i].msgs;
+            for (b = 0; b < HIST_BUCKETS; b++)
+                hist[b] += w[i].hist[b];
+        }
+        eagain += w[i].eagain;
+        errors += w[i].errors;
+    }
+    for (b = 0; b < HIST_BUCKETS && msgs; b++) {
+        if (hist[b]) {
+            if (!lat_min)
+                lat_min = hist_value(b);
+            lat_max = hist_value(b);
+        }
+    }
+
+    mbps = msgs * cfg.msg_size / elapsed / 1e6;
+    msgps = msgs / elapsed;
+
+#define PCT(p) (msgs ? hist_percentile(hist, msgs, p) : 0)
+    if (cfg.json) {
+        printf("{\"device\":\"%s\",\"msg_size\":%zu,\"producers\":%d,\"consumers\":%d,"
+               "\"io\":\"%s\",\"record\":%s,\"percpu\":%s,\"duration_s\":%.3f,"
+               "\"msgs_sent\":%llu,\"msgs_received\":%llu,"
+               "\"mb_per_s\":%.3f,\"msgs_per_s\":%.1f,"
+               "\"write_ops_per_s\":%.1f,\"read_ops_per_s\":%.1f,"
+               "\"latency_ns\":{\"min\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},"
+               "\"eagain\":%llu,\"errors\":%llu}\n",
+               cfg.dev, cfg.msg_size, cfg.producers, cfg.consumers,
+               io_mode_names[cfg.io], cfg.stream ? "false" : "true",
+               cfg.percpu ? "true" : "false", elapsed,
+               (unsigned long long)sent, (unsigned long long)msgs,
+               mbps, msgps, writes / elapsed, reads / elapsed,
+               (unsigned long long)lat_min, (unsigned long long)PCT(0.5),
+               (unsigned long long)PCT(0.99), (unsigned long long)PCT(0.999),
+               (unsigned long long)lat_max,
+               (unsigned long long)eagain, (unsigned long long)errors);
+    } else {
+        printf("%s: %zu-byte messages, %d producer(s), %d consumer(s), %s I/O, %s%s, %.2f s\n",
+               cfg.dev, cfg.msg_size, cfg.producers, cfg.consumers, io_mode_names[cfg.io],
+               cfg.stream ? "stream" : "records", cfg.percpu ? ", per-CPU" : "", elapsed);
+        printf("  throughput: %.2f MB/s, %.0f msg/s (%.0f writes/s, %.0f reads/s)\n",
+               mbps, msgps, writes / elapsed, reads / elapsed);
+        printf("  latency ns: min %llu  p50 %llu  p99 %llu  p999 %llu  max %llu\n",
+               (unsigned long long)lat_min, (unsigned long long)PCT(0.5),
+               (unsigned long long)PCT(0.99), (unsigned long long)PCT(0.999),
+               (unsigned long long)lat_max);
+        printf("  messages: %llu sent, %llu received; EAGAIN %llu, errors %llu\n",
+               (unsigned long long)sent, (unsigned long long)msgs,
+               (unsigned long long)eagain, (unsigned long long)errors);
+    }
+#undef PCT
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction sa = { .sa_handler = wakeup_handler };
+    struct scull_wmark old_wmark, wmark;
+    struct timespec run;
+    struct worker *w;
+    uint64_t start, end, sent = 0;
+    int ctl_fd, old_mode, mode, flags, n, i, ret = EXIT_FAILURE;
+
+    if (parse_args(argc, argv))
+        return EXIT_FAILURE;
+    n = cfg.producers + cfg.consumers;
+
+    // Без SA_RESTART: сигнал должен вывести поток из сна в драйвере
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    ctl_fd = open(cfg.dev, O_RDONLY | O_NONBLOCK);
+    if (ctl_fd < 0) {
+        perror(cfg.dev);
+        return EXIT_FAILURE;
+    }
+    old_mode = ioctl(ctl_fd, SCULL_IOC_GET_MODE);
+    if (old_mode < 0) {
+        perror("SCULL_IOC_GET_MODE");
+        goto out_close;
+    }
+    if (ioctl(ctl_fd, SCULL_IOC_GET_WMARK, &old_wmark) < 0) {
+        perror("SCULL_IOC_GET_WMARK");
+        goto out_close;
+    }
+    mode = (cfg.stream ? 0 : SCULL_MODE_RECORD) | (cfg.percpu ? SCULL_MODE_PERCPU : 0);
+    drain_device();
+    if (ioctl(ctl_fd, SCULL_IOC_SET_MODE, mode) < 0) {
+        perror("SCULL_IOC_SET_MODE");
+        goto out_close;
+    }
+    // poll сообщает о месте с порога write_high: в режиме записей ждем места
+    // под целую запись, иначе писатель крутится между poll и EAGAIN
+    wmark = old_wmark;
+    if (!cfg.stream && cfg.io == IO_POLL)
+        wmark.write_high = cfg.msg_size + sizeof(struct scull_record_hdr);
+    if (ioctl(ctl_fd, SCULL_IOC_SET_WMARK, &wmark) < 0) {
+        perror("SCULL_IOC_SET_WMARK");
+        goto out_mode;
+    }
+
+    w = calloc(n, sizeof(*w));
+    if (!w) {
+        perror("calloc");
+        goto out_mode;
+    }
+
+    flags = cfg.io == IO_BLOCK ? 0 : O_NONBLOCK;
+    for (i = 0; i < n; i++) {
+        w[i].id = i;
+        w[i].producer = i < cfg.producers;
+        w[i].fd = open(cfg.dev, (w[i].producer ? O_WRONLY : O_RDONLY) | flags);
+        if (w[i].fd < 0) {
+            perror(cfg.dev);
+            n = i;
+            goto out_fds;
+        }
+    }
+
+    start = now_ns();
+    for (i = 0; i < n; i++) {
+        errno = pthread_create(&w[i].thread, NULL,
+                               w[i].producer ? producer_main : consumer_main, &w[i]);
+        if (errno) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    run.tv_sec = (time_t)cfg.duration;
+    run.tv_nsec = (long)((cfg.duration - run.tv_sec) * 1e9);
+    while (nanosleep(&run, &run) && errno == EINTR)
+        ;
+
+    // Останавливаем продюсеров, даем консюмерам дочитать отправленное и
+    // только потом останавливаем их
+    stop_workers(w, cfg.producers, &stop_producers);
+    for (i = 0; i < cfg.producers; i++)
+        sent += w[i].msgs;
+    while (atomic_load(&consumed_msgs) < sent && now_ns() - start <
+           (uint64_t)(cfg.duration * 1e9) + DRAIN_TIMEOUT_NS)
+        sched_yield();
+    end = now_ns();
+    stop_workers(w + cfg.producers, cfg.consumers, &stop_consumers);
+
+    report(w, (end - start) / 1e9);
+    ret = EXIT_SUCCESS;
+    for (i = 0; i < n; i++)
+        if (w[i].errors)
+            ret = EXIT_FAILURE;
+
+out_fds:
+    for (i = 0; i < n; i++)
+        close(w[i].fd);
+    free(w);
+out_mode:
+    drain_device();
+    if (ioctl(ctl_fd, SCULL_IOC_SET_WMARK, &old_wmark) < 0)
+        perror("restore SCULL_IOC_SET_WMARK");
+    if (ioctl(ctl_fd, SCULL_IOC_SET_MODE, old_mode) < 0)
+        perror("restore SCULL_IOC_SET_MODE");
+out_close:
+    close(ctl_fd);
+    return ret;
+}
@@ -0,0 +1,266 @@
+#ifndef SCULL_IOCTL_H
+#define SCULL_IOCTL_H
+
+// Общий для драйвера и пользовательских программ интерфейс scull_ring_buffer:
+// номера ioctl и разметка области, отображаемой через mmap.
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define SCULL_IOC_MAGIC 'k'
+
+// Размер строки кэша, по которому разнесены поля продюсера и консюмера
+#define SCULL_CACHELINE 64
+
+/*
+ * Разметка mmap: по смещению 0 лежит страница управления (struct scull_ring_ctrl),
+ * по смещению ctrl->data_offset - ctrl->size байт данных кольца.
+ *
+ * head и tail - позиции записи и чтения в диапазоне [0, 2 * size). Индекс в
+ * области данных равен pos (если pos < size) или pos - size. Буфер пуст при
+ * head == tail и полон, когда head - tail (по модулю 2 * size) равно size.
+ *
+ * Продюсер копирует данные по индексу head, затем публикует новый head
+ * store-release; консюмер читает head load-acquire, забирает данные и так же
+ * публикует tail. Каждую сторону в один момент ведёт только один процесс.
+ * После публикации нужен полный барьер и проверка счётчика спящих на другой
+ * стороне: если он не ноль - вызвать SCULL_IOC_NOTIFY, чтобы их разбудить.
+ */
+struct scull_ring_ctrl {
+    __u32 head __attribute__((aligned(SCULL_CACHELINE)));  // Пишет только продюсер
+    __u32 tail __attribute__((aligned(SCULL_CACHELINE)));  // Пишет только консюмер
+    __u32 size __attribute__((aligned(SCULL_CACHELINE)));  // Размер области данных
+    __u32 data_offset;     // Смещение данных от начала отображения
+    __u32 read_waiters;    // Сколько процессов спит в ожидании данных
+    __u32 write_waiters;   // Сколько процессов спит в ожидании места
+    __u32 mode;            // Флаги SCULL_MODE_*, определяют формат данных в кольце
+};
+
+// Режим записей: каждый write(2) кладет в кольцо одну запись целиком -
+// заголовок struct scull_record_hdr и len байт данных. read(2) возвращает
+// столько целых записей (вместе с заголовками), сколько помещается в буфер,
+// и -EMSGSIZE, если не помещается даже первая. mmap-клиенты в этом режиме
+// обязаны публиковать head только на границе записи. При splice(2) и
+// sendfile(2) в устройство записью становится порция, которую ядро передает
+// за один раз (до размера канала), а не отдельный write(2) в канал.
+// poll сообщает EPOLLOUT, когда свободно write_high байт (SCULL_IOC_SET_WMARK),
+// в этом режиме - не меньше sizeof(struct scull_record_hdr) + 1. Запись
+// длиннее порога после EPOLLOUT может получить EAGAIN: чтобы poll ждал места
+// под всю запись, write_high задают по размеру записей
+#define SCULL_MODE_RECORD     0x1
+// Режим под-колец: буфер делится на срезы по номерам CPU. Размер среза -
+// size / nr_cpu_ids (в режиме pow2_size - степень двойки), срез CPU n лежит
+// по смещению n * срез. Каждый CPU пишет в свой срез под своим мьютексом, и
+// писатели разных CPU не конкурируют. Под-кольца есть только у возможных CPU,
+// поэтому вмещает устройство num_possible_cpus() срезов: при разреженных
+// номерах CPU срезы пропущенных номеров и остаток буфера не используются. Порядок сохраняется только
+// внутри под-кольца: данные одного писателя, пока он не сменил CPU, читаются
+// в порядке записи, между под-кольцами порядка нет. Читатель обходит
+// под-кольца по кругу. mmap и SCULL_IOC_RESIZE в этом режиме недоступны (-EBUSY).
+// Сочетается с SCULL_MODE_RECORD: запись целиком лежит в одном под-кольце
+#define SCULL_MODE_PERCPU     0x2
+// Режим перезаписи (бортовой самописец): писатель никогда не ждет - если места
+// не хватает, из кольца выбрасываются старейшие данные (в режиме записей -
+// старейшие записи целиком), а write(2) в потоковом режиме кладет сразу до size
+// байт. Читатель всегда получает целые данные: если их перезаписали во время
+// копирования, чтение повторяется с нового tail. Сколько байт выброшено,
+// возвращает SCULL_IOC_GET_DROPPED. Не сочетается с SCULL_MODE_PERCPU (-EINVAL);
+// mmap в этом режиме недоступен (-EBUSY), PEEK и COMMIT возвращают -EOPNOTSUPP
+#define SCULL_MODE_OVERWRITE  0x4
+// Метки времени (только вместе с SCULL_MODE_RECORD, иначе -EINVAL): write(2)
+// кладет в начало данных каждой записи __u64 - момент постановки в очередь
+// по CLOCK_MONOTONIC в наносекундах, и len заголовка учитывает эти 8 байт.
+// write(2) по-прежнему принимает и возвращает только полезные данные, read(2)
+// отдает запись вместе с меткой: { len, время, данные }. Время пребывания
+// записей в кольце при read(2) собирается в гистограмму residency_us в
+// debugfs (кроме режима перезаписи). mmap-продюсеры кладут метку сами;
+// связь SCULL_IOC_LINK переносит ее без изменений, так что в последнем
+// устройстве цепочки видно время от первой записи
+#define SCULL_MODE_TIMESTAMP  0x8
+// Режим раздачи работы пулу читателей: спящие read(2) ждут в эксклюзивной
+// очереди, и запись будит одного из них, а не всех. Читатель, оставивший в
+// кольце данные, передает пробуждение следующему, так что просыпается
+// столько читателей, сколько есть работы. В режиме записей read(2) отдает
+// ровно одну запись, даже если в буфер поместилось бы больше: сообщение
+// целиком достается одному читателю. poll(2) и SCULL_IOC_WAIT_DATA будят
+// как обычно. Не сочетается с SCULL_MODE_PERCPU и SCULL_MODE_OVERWRITE (-EINVAL)
+#define SCULL_MODE_WORKQUEUE  0x10
+
+struct scull_record_hdr {
+    __u32 len;             // Длина данных записи без заголовка
+};
+
+// Уснуть, пока в буфере не будет хотя бы arg байт (0 - хотя бы один байт)
+#define SCULL_IOC_WAIT_DATA   _IO(SCULL_IOC_MAGIC, 1)
+// Уснуть, пока в буфере не освободится хотя бы arg байт (0 - хотя бы один байт)
+#define SCULL_IOC_WAIT_SPACE  _IO(SCULL_IOC_MAGIC, 2)
+// Разбудить ожидающих после того, как head или tail сдвинут через mmap
+#define SCULL_IOC_NOTIFY      _IO(SCULL_IOC_MAGIC, 3)
+// Установить режим SCULL_MODE_* (arg). Только для пустого буфера, иначе -EBUSY
+#define SCULL_IOC_SET_MODE    _IO(SCULL_IOC_MAGIC, 4)
+// Текущий режим возвращается как результат ioctl
+#define SCULL_IOC_GET_MODE    _IO(SCULL_IOC_MAGIC, 5)
+// Изменить размер буфера на arg байт, сохранив данные. -ENOSPC, если данные не
+// помещаются в новый размер, -EBUSY, если буфер отображен через mmap
+#define SCULL_IOC_RESIZE      _IO(SCULL_IOC_MAGIC, 6)
+
+// Пороги пробуждения. Писатель будит читателей, только когда в буфере
+// накопилось read_low байт, а если данных меньше - через timeout_ms после
+// записи (0 - только по порогу). Читатель будит писателей, только когда
+// освободилось write_high байт; с того же свободного места poll сообщает
+// EPOLLOUT. Пороги приводятся к [1, size]; по умолчанию
+// оба равны 1 - будить после каждой операции. Засыпая, каждая сторона будит
+// другую независимо от порогов, поэтому взаимной блокировки нет
+struct scull_wmark {
+    __u32 read_low;        // Заполненность, при которой будим читателей
+    __u32 write_high;      // Свободное место, при котором будим писателей
+    __u32 timeout_ms;      // Сколько читатель может ждать данных ниже порога
+};
+
+#define SCULL_IOC_SET_WMARK   _IOW(SCULL_IOC_MAGIC, 7, struct scull_wmark)
+#define SCULL_IOC_GET_WMARK   _IOR(SCULL_IOC_MAGIC, 8, struct scull_wmark)
+
+// Двухфазное чтение для одного консюмера. SCULL_IOC_PEEK копирует в buf до len
+// байт (в режиме записей - сколько целых записей помещается), лежащих после
+// первых offset байт от tail, и возвращает число скопированных байт; tail не
+// сдвигается. offset - сумма уже просмотренного, в режиме записей - на границе
+// записи. Без O_NONBLOCK ждет данных, с ним возвращает -EAGAIN; -ENOBUFS -
+// новых данных не будет, пока не подтвердить просмотренное.
+// SCULL_IOC_COMMIT (arg - байт) сдвигает tail, т.е. извлекает данные; в режиме
+// записей arg обязан попасть на границу записи, иначе -EINVAL.
+// В режиме SCULL_MODE_PERCPU обе команды возвращают -EOPNOTSUPP
+struct scull_peek {
+    __u64 buf;             // Адрес буфера пользователя
+    __u32 len;             // Размер буфера
+    __u32 offset;          // Сколько байт после tail пропустить
+};
+
+#define SCULL_IOC_PEEK        _IOW(SCULL_IOC_MAGIC, 9, struct scull_peek)
+#define SCULL_IOC_COMMIT      _IO(SCULL_IOC_MAGIC, 10)
+
+// Сколько байт выброшено в режиме перезаписи за время жизни устройства.
+// Читатель замечает потерю данных по росту счетчика между вызовами
+#define SCULL_IOC_GET_DROPPED _IOR(SCULL_IOC_MAGIC, 11, __u64)
+
+// Связь с устройством-приемником /dev/scull_ring_buffer<arg>: драйвер сам
+// переносит данные из этого устройства в приемник по мере появления места,
+// без процесса-посредника. Пока приемник полон, данные копятся здесь, и
+// писатели этого устройства засыпают как обычно. Перенос - еще один читатель
+// этого устройства и писатель приемника, упорядоченный с read(2)/write(2);
+// mmap-клиенты на этих сторонах с ним не согласованы. arg = -1 разрывает связь.
+// Оба устройства - не в SCULL_MODE_PERCPU и SCULL_MODE_OVERWRITE, с одинаковыми
+// SCULL_MODE_RECORD и SCULL_MODE_TIMESTAMP; в режиме записей приемник не меньше источника (-EINVAL).
+// У устройства один приемник и один источник (-EBUSY), цикл - -ELOOP. Пока
+// связь есть, SET_MODE и RESIZE на обоих возвращают -EBUSY, а приемник
+// нельзя удалить через scull_ctl
+#define SCULL_IOC_LINK        _IO(SCULL_IOC_MAGIC, 12)
+
+// Асинхронные уведомления для циклов событий. SCULL_IOC_SET_EVENTFD
+// регистрирует eventfd fd для событий SCULL_EVENT_* (fd = -1 снимает
+// регистрацию этих событий). На каждое событие у устройства один eventfd,
+// новая регистрация заменяет старую; снимается она и при закрытии файла,
+// через который сделана. Сигнал приходит на фронте - когда устройство (как
+// его видит poll) из "не готово" стало "готово", и сразу при регистрации,
+// если уже готово; после сигнала читать (писать) нужно до EAGAIN.
+// Место для записи считается на любом CPU: в SCULL_MODE_PERCPU - в каждом
+// под-кольце. Неблокирующая запись, получившая EAGAIN, снимает готовность:
+// следующий сигнал придет, когда освободится место под эту запись.
+// SIGIO на тех же фронтах включается через fcntl(F_SETOWN) и O_ASYNC,
+// si_band - POLL_IN или POLL_OUT
+#define SCULL_EVENT_READABLE  0x1   // Появились данные
+#define SCULL_EVENT_WRITABLE  0x2   // Появилось место
+
+struct scull_eventfd {
+    __s32 fd;              // eventfd или -1
+    __u32 events;          // SCULL_EVENT_*
+};
+
+#define SCULL_IOC_SET_EVENTFD _IOW(SCULL_IOC_MAGIC, 13, struct scull_eventfd)
+
+// Состояние устройства без мьютексов - опрос не мешает чтению и записи.
+// Поля только добавляются в конец, с ростом SCULL_STATUS_VERSION; размер
+// структуры входит в номер команды, и драйвер отдает программе ровно ее
+// версию структуры (поля, которых он не знает, обнуляются)
+#define SCULL_STATUS_VERSION  1
+
+struct scull_status {
+    __u32 version;         // SCULL_STATUS_VERSION драйвера
+    __u32 minor;
+    __u32 mode;            // Флаги SCULL_MODE_*
+    __u32 read_waiters;    // Сколько процессов спит в ожидании данных
+    __u32 write_waiters;   // ... и места
+    __u32 reserved;
+    __u64 size;            // Размер буфера
+    __u64 capacity;        // Сколько данных помещается (в режиме под-колец меньше size)
+    __u64 data_size;       // Сколько данных в буфере
+    __u64 read_index;      // Индекс tail в буфере (в режиме под-колец не определен)
+    __u64 write_index;     // Индекс head
+    __u64 read_bytes;      // Счетчики за время жизни устройства
+    __u64 write_bytes;
+    __u64 read_ops;
+    __u64 write_ops;
+    __u64 dropped_bytes;   // Выброшено в режиме перезаписи
+    __u64 forward_bytes;   // Перенесено по связи SCULL_IOC_LINK
+};
+
+#define SCULL_IOC_STATUS      _IOR(SCULL_IOC_MAGIC, 14, struct scull_status)
+
+/*
+ * Страница телеметрии: mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd,
+ * SCULL_TELEMETRY_OFFSET). Только чтение (PROT_WRITE - EPERM). Пока страница
+ * отображена хоть одним процессом, драйвер раз в interval_ms (параметр
+ * модуля telemetry_ms) кладет в нее struct scull_status, так что монитор
+ * читает состояние без системных вызовов, а чтение и запись об этом не знают.
+ *
+ * Читать как seqcount: s = seq (load-acquire); если s нечетный - повторить;
+ * скопировать страницу; барьер чтения; если seq != s - повторить.
+ * update_ns - момент обновления по CLOCK_MONOTONIC, по нему удобно считать
+ * скорости из разности счетчиков.
+ *
+ * Отображение страницы не держит устройство: SCULL_CTL_DESTROY удаляет его и
+ * при работающем мониторе. Тогда страница перестает обновляться и получает
+ * флаг SCULL_TELEMETRY_REMOVED - монитору пора снять отображение и, если
+ * нужно, открыть устройство заново, когда оно появится. Сам open(2) на время
+ * до mmap держит устройство, и удаление в этот момент вернет -EBUSY.
+ */
+#define SCULL_TELEMETRY_OFFSET 0x60000000UL  // За областью данных наибольшего буфера
+
+#define SCULL_TELEMETRY_REMOVED 0x1  // Устройство удалено, страница больше не обновится
+
+struct scull_telemetry {
+    __u32 seq;             // Нечетный - страница обновляется
+    __u32 interval_ms;     // Период обновления
+    __u64 update_ns;       // CLOCK_MONOTONIC последнего обновления
+    struct scull_status status;
+    __u32 flags;           // SCULL_TELEMETRY_*
+    __u32 reserved;
+};
+
+// Управляющее устройство /dev/scull_ctl: создание и удаление кольцевых устройств
+// без перезагрузки модуля (нужен CAP_SYS_ADMIN). SCULL_CTL_CREATE возвращает
+// minor нового устройства /dev/scull_ring_buffer<minor>: -EEXIST, если
+// запрошенный minor занят, -ENOSPC, если свободных нет. SCULL_CTL_DESTROY
+// (arg - minor) удаляет устройство; -EBUSY, пока оно открыто или отображено
+struct scull_create {
+    __u32 size;            // Размер буфера, 0 - как у устройств при загрузке
+    __u32 mode;            // Флаги SCULL_MODE_*, как для SCULL_IOC_SET_MODE
+    __s32 node;            // NUMA-узел буфера, -1 - любой
+    __s32 minor;           // Нужный minor, -1 - первый свободный
+};
+
+#define SCULL_CTL_CREATE      _IOW(SCULL_IOC_MAGIC, 32, struct scull_create)
+#define SCULL_CTL_DESTROY     _IO(SCULL_IOC_MAGIC, 33)
+
+// Снимок состояния всех устройств за один вызов (CAP_SYS_ADMIN не нужен:
+// /dev/scull_ctl создается с правами 0644, хватает открытия на чтение).
+// Драйвер заполняет до count структур по size байт и возвращает в count число
+// устройств; если оно больше переданного, массив был мал
+struct scull_status_all {
+    __u64 buf;             // Адрес массива struct scull_status
+    __u32 count;           // Вход: длина массива, выход: число устройств
+    __u32 size;            // sizeof(struct scull_status) программы
+};
+
+#define SCULL_CTL_STATUS_ALL  _IOWR(SCULL_IOC_MAGIC, 34, struct scull_status_all)
+
+#endif // SCULL_IOCTL_H
@@ -0,0 +1,274 @@
+#ifndef SCULL_RING_H
+#define SCULL_RING_H
+
+// Ядро кольцевого буфера scull_ring_buffer: арифметика позиций, копирование
+// с заворотом и разбор записей. Собирается и в модуле, и в user space
+// (scull_ring_stress), поэтому не зависит ни от iov_iter, ни от блокировок:
+// вызывающий сам упорядочивает писателей между собой и читателей между собой.
+//
+// Позиции head/tail живут в диапазоне [0, 2 * size): так полный буфер
+// (head - tail == size) отличается от пустого без отдельного счетчика.
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+#include <asm/barrier.h>
+#else
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+typedef uint32_t u32;
+
+// Примитивы ядра на атомиках компилятора: их понимают TSan и ASan
+#define READ_ONCE(x)            __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v)        __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define unlikely(x)             __builtin_expect(!!(x), 0)
+#define min_t(type, a, b)       ((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#define is_power_of_2(n)        ((n) != 0 && ((n) & ((n) - 1)) == 0)
+#endif
+
+#include "scull_ioctl.h"
+
+// Кольцо: буфер и позиции head/tail в диапазоне [0, 2 * size).
+// Сами позиции лежат снаружи - в странице управления или в под-кольце
+struct scull_ring {
+    char *buffer;                   // Указатель на кольцевой буфер
+    u32 size;                       // Размер кольцевого буфера
+    u32 mask;                       // size - 1, если size - степень двойки, иначе 0
+    __u32 *head;                    // Позиция записи, меняет только писатель
+    __u32 *tail;                    // Позиция чтения, меняет только читатель
+};
+
+// Загружаем позицию head/tail. Страница управления доступна пользователю на запись,
+// поэтому значение приводим к допустимому диапазону, чтобы не выйти за буфер
+static inline u32 scull_ring_load(const struct scull_ring *ring, const __u32 *pos)
+{
+    u32 val = smp_load_acquire(pos);
+
+    if (unlikely(val >= 2 * ring->size))
+        val %= 2 * ring->size;
+    return val;
+}
+
+// Индекс в буфере, соответствующий позиции. Для размера - степени двойки
+// это просто маска, иначе одно сравнение
+static inline u32 scull_ring_index(const struct scull_ring *ring, u32 pos)
+{
+    if (ring->mask)
+        return pos & ring->mask;
+    return pos >= ring->size ? pos - ring->size : pos;
+}
+
+// Сдвиг позиции на n байт с заворотом по 2 * size - без деления
+static inline u32 scull_ring_advance(const struct scull_ring *ring, u32 pos, u32 n)
+{
+    if (ring->mask)
+        return (pos + n) & (2 * ring->mask + 1);
+
+    pos += n;
+    if (pos >= 2 * ring->size)
+        pos -= 2 * ring->size;
+    return pos;
+}
+
+// Количество данных между tail и head
+static inline u32 scull_ring_used(const struct scull_ring *ring, u32 head, u32 tail)
+{
+    u32 used;
+
+    if (ring->mask)
+        used = (head - tail) & (2 * ring->mask + 1);
+    else
+        used = head >= tail ? head - tail : head + 2 * ring->size - tail;
+
+    return min_t(u32, used, ring->size);
+}
+
+// Текущее количество данных в кольце. Больше не хранится отдельно, а
+// вычисляется из head и tail, которые могут двигать и mmap-клиенты
+static inline u32 scull_ring_data_size(const struct scull_ring *ring)
+{
+    return scull_ring_used(ring, scull_ring_load(ring, ring->head),
+                           scull_ring_load(ring, ring->tail));
+}
+
+// Размер кольца и маска для индексов
+static inline void scull_ring_init(struct scull_ring *ring, char *buffer, u32 size,
+                                   __u32 *head, __u32 *tail)
+{
+    ring->buffer = buffer;
+    ring->size = size;
+    ring->mask = is_power_of_2(size) && size > 1 ? size - 1 : 0;
+    ring->head = head;
+    ring->tail = tail;
+}
+
+// Сколько из len байт, начиная с pos, лежит до конца буфера. Остаток
+// len - first лежит с начала буфера: любое копирование идет в две части
+static inline u32 scull_ring_first(const struct scull_ring *ring, u32 pos, u32 len)
+{
+    return min_t(u32, len, ring->size - scull_ring_index(ring, pos));
+}
+
+// Копирование между кольцом и обычной памятью с учетом заворота
+static inline void scull_ring_copy_out(const struct scull_ring *ring, u32 pos, void *dst, u32 len)
+{
+    u32 first_part = scull_ring_first(ring, pos, len);
+
+    memcpy(dst, ring->buffer + scull_ring_index(ring, pos), first_part);
+    memcpy((char *)dst + first_part, ring->buffer, len - first_part);
+}
+
+static inline void scull_ring_copy_in(struct scull_ring *ring, u32 pos, const void *src, u32 len)
+{
+    u32 first_part = scull_ring_first(ring, pos, len);
+
+    memcpy(ring->buffer + scull_ring_index(ring, pos), src, first_part);
+    memcpy(ring->buffer, (const char *)src + first_part, len - first_part);
+}
+
+// Перенос len байт из кольца src (с позиции tail) в кольцо dst (с позиции
+// head) без промежуточного буфера: кусками, не переходящими через конец ни
+// одного из колец - их не больше трех
+static inline void scull_ring_move(struct scull_ring *dst, u32 head,
+                                   const struct scull_ring *src, u32 tail, u32 len)
+{
+    u32 chunk;
+
+    while (len) {
+        chunk = min_t(u32, scull_ring_first(src, tail, len), scull_ring_first(dst, head, len));
+        memcpy(dst->buffer + scull_ring_index(dst, head), src->buffer + scull_ring_index(src, tail), chunk);
+        head = scull_ring_advance(dst, head, chunk);
+        tail = scull_ring_advance(src, tail, chunk);
+        len -= chunk;
+    }
+}
+
+// Сколько байт целых записей, начиная с tail, помещается в count.
+// В *need возвращает, сколько данных должно лежать в буфере, чтобы первая
+// запись была целой: пока продюсер mmap ее не дописал, читателю надо ждать
+static inline long scull_record_span(const struct scull_ring *ring, u32 tail, u32 data_size,
+                                     size_t count, u32 *need)
+{
+    struct scull_record_hdr hdr;
+    u32 span = 0;
+    u32 record;
+
+    *need = sizeof(hdr);
+    while (data_size - span >= sizeof(hdr)) {
+        scull_ring_copy_out(ring, scull_ring_advance(ring, tail, span), &hdr, sizeof(hdr));
+        // Такой записи не может быть в буфере - кольцо испорчено через mmap
+        if (hdr.len > ring->size - sizeof(hdr))
+            return -EIO;
+
+        record = sizeof(hdr) + hdr.len;
+        if (span == 0)
+            *need = record;
+        if (record > data_size - span)
+            break;
+        if (span + record > count)
+            return span ? (long)span : -EMSGSIZE;
+        span += record;
+    }
+    return span;
+}
+
+// Сколько байт нужно свободного места, чтобы записать count байт: в режиме
+// записей - вся запись с заголовком, иначе хоть один байт
+static inline long scull_ring_need(const struct scull_ring *ring, size_t count, bool record)
+{
+    if (!record)
+        return 1;
+    if (count > ring->size - sizeof(struct scull_record_hdr))
+        return -EMSGSIZE;
+    return sizeof(struct scull_record_hdr) + count;
+}
+
+// Начало записи: в режиме записей кладет заголовок. Возвращает позицию, с
+// которой копировать данные, в *len - сколько байт данных скопировать
+// (в потоковом режиме - не больше свободного места space)
+static inline u32 scull_ring_put_begin(struct scull_ring *ring, u32 head, size_t count,
+                                       u32 space, bool record, u32 *len)
+{
+    struct scull_record_hdr hdr = { .len = (__u32)count };
+
+    if (!record) {
+        *len = min_t(size_t, count, space);
+        return head;
+    }
+    scull_ring_copy_in(ring, head, &hdr, sizeof(hdr));
+    *len = count;
+    return scull_ring_advance(ring, head, sizeof(hdr));
+}
+
+// Сколько байт читать, начиная с tail: до count байт или столько целых записей,
+// сколько помещается. 0 - читать пока нечего (в *need - сколько данных ждать)
+static inline long scull_ring_get_span(const struct scull_ring *ring, u32 tail, size_t count,
+                                       bool record, u32 *need)
+{
+    u32 data_size = scull_ring_data_size(ring);
+
+    if (record)
+        return scull_record_span(ring, tail, data_size, count, need);
+    *need = 1;
+    return min_t(size_t, count, data_size);
+}
+
+// Публикация позиций: данные становятся видны другой стороне не раньше,
+// чем новый head (tail)
+static inline void scull_ring_commit_head(struct scull_ring *ring, u32 head, u32 n)
+{
+    smp_store_release(ring->head, scull_ring_advance(ring, head, n));
+}
+
+static inline void scull_ring_commit_tail(struct scull_ring *ring, u32 tail, u32 n)
+{
+    smp_store_release(ring->tail, scull_ring_advance(ring, tail, n));
+}
+
+// Запись и чтение из обычной памяти - то же, что делают read(2) и write(2)
+// драйвера, без iov_iter. Запись: -EAGAIN, если места меньше нужного
+static inline ssize_t scull_ring_write(struct scull_ring *ring, const void *src,
+                                       size_t count, bool record)
+{
+    u32 head = scull_ring_load(ring, ring->head);
+    u32 space = ring->size - scull_ring_data_size(ring);
+    long need = scull_ring_need(ring, count, record);
+    u32 pos, len;
+
+    if (need < 0)
+        return need;
+    if (space < need)
+        return -EAGAIN;
+
+    pos = scull_ring_put_begin(ring, head, count, space, record, &len);
+    scull_ring_copy_in(ring, pos, src, len);
+    scull_ring_commit_head(ring, head, record ? sizeof(struct scull_record_hdr) + len : len);
+    return len;
+}
+
+// Чтение: 0 - читать пока нечего
+static inline ssize_t scull_ring_read(struct scull_ring *ring, void *dst, size_t count,
+                                      bool record, u32 *need)
+{
+    u32 tail = scull_ring_load(ring, ring->tail);
+    long len = scull_ring_get_span(ring, tail, count, record, need);
+
+    if (len <= 0)
+        return len;
+    scull_ring_copy_out(ring, tail, dst, len);
+    scull_ring_commit_tail(ring, tail, len);
+    return len;
+}
+
+#endif // SCULL_RING_H
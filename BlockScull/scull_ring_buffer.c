@@ -5,6 +5,7 @@
 #include <linux/cdev.h>      // Структура cdev для символьных устройств
 #include <linux/slab.h>      // Функции выделения памяти в ядре (kmalloc, kfree)
 #include <linux/uaccess.h>   // Функции копирования между ядром и пользователем
+#include <linux/uio.h>       // iov_iter для read_iter/write_iter
 #include <linux/wait.h>      // Очереди ожидания для синхронизации
 #include <linux/sched.h>     // Определения структур процессов
 #include <linux/mutex.h>     // Мьютексы для взаимного исключения
@@ -12,259 +13,2568 @@
 #include <linux/device.h> // for device_create/device_destroy
 #include <linux/version.h> // for kenel version
 #include <linux/moduleparam.h>
+#include <linux/vmalloc.h>   // Буфер из vmalloc - постранично отображается в user space
+#include <linux/mm.h>        // vm_insert_page для mmap
+#include <linux/numa.h>      // NUMA_NO_NODE, размещение буфера по узлам
+#include <linux/nodemask.h>
+#include <linux/topology.h>  // cpumask_of_node
+#include <linux/poll.h>      // poll_wait и маски EPOLL*
+#include <linux/log2.h>      // is_power_of_2, roundup_pow_of_two
+#include <linux/percpu.h>    // Под-кольца писателей по CPU
+#include <linux/cpumask.h>   // for_each_possible_cpu
+#include <linux/splice.h>    // splice_read/splice_write для splice(2) и sendfile(2)
+#include <linux/workqueue.h> // Отложенное пробуждение читателей ниже порога
+#include <linux/jiffies.h>
+#include <linux/debugfs.h>   // Статистика в /sys/kernel/debug/scull_ring_buffer
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/kref.h>      // Время жизни устройств, созданных через /dev/scull_ctl
+#include <linux/miscdevice.h>
+#include <linux/capability.h>
+#include <linux/eventfd.h>   // Уведомления о готовности для циклов событий
+#include <linux/highmem.h>   // memcpy_to_page: передача в закрепленные страницы читателя
+#include <linux/sched/task.h> // get_task_struct: читатель прямой передачи
+#include <linux/anon_inodes.h> // Отображение телеметрии не держит файл устройства
+
+#include "scull_ioctl.h"
+#include "scull_ring.h"      // Арифметика позиций и копирование, общие с user space
+
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
 
 #define DEVICE_NAME "scull_ring_buffer"
 
 #define DEFAULT_BUFFER_SIZE 1024
 #define DEFAULT_NUM_DEVICES 2
+// Сколько minor резервируется под устройства, создаваемые при загрузке и через scull_ctl
+#define MAX_DEVICES 256
+// Позиции head/tail живут в диапазоне [0, 2 * size) и должны помещаться в u32
+#define MAX_BUFFER_SIZE (1 << 30)
+// Все режимы, которые понимает драйвер
+#define SCULL_MODE_ALL (SCULL_MODE_RECORD | SCULL_MODE_PERCPU | SCULL_MODE_OVERWRITE | \
+                        SCULL_MODE_TIMESTAMP | SCULL_MODE_WORKQUEUE)
+// Минимальный размер под-кольца одного CPU
+#define MIN_SUBRING_SIZE 64
+// Таймаут пробуждения читателей ниже порога по умолчанию и наибольший допустимый
+#define DEFAULT_WAKE_TIMEOUT_MS 10
+#define MAX_WAKE_TIMEOUT_MS 60000
+// Сколько устройств можно разместить по узлам параметром numa_node
+#define MAX_NUMA_NODE_PARAMS 64
+// Период обновления страницы телеметрии по умолчанию и наибольший допустимый
+#define DEFAULT_TELEMETRY_MS 10
+#define MAX_TELEMETRY_MS 10000
+// Сколько страниц буфера читателя закрепляется для прямой передачи
+#define SCULL_HANDOFF_PAGES 16
 
 // Module params - can be set in insmod
 static int num_devices = DEFAULT_NUM_DEVICES;
 static int buffer_size = DEFAULT_BUFFER_SIZE;
+static bool record_mode = false;
+static bool pow2_size = false;
+static bool hugepages = false;
+static int numa_node[MAX_NUMA_NODE_PARAMS] = { [0 ... MAX_NUMA_NODE_PARAMS - 1] = NUMA_NO_NODE };
+static int numa_node_count;
+static int telemetry_ms = DEFAULT_TELEMETRY_MS;
+static unsigned int handoff_min = PAGE_SIZE;
 
 // Declare module params
 module_param(num_devices, int, S_IRUGO);
-MODULE_PARM_DESC(num_devices, "Number of scull devices to create (default: 2)");
+MODULE_PARM_DESC(num_devices, "Number of scull devices to create at load time, more can be added via /dev/scull_ctl (default: 2)");
 
 module_param(buffer_size, int, S_IRUGO);
 MODULE_PARM_DESC(buffer_size
             , "Size of each circular buffer in bytes (default: 1024)");
 
+module_param(record_mode, bool, S_IRUGO);
+MODULE_PARM_DESC(record_mode
+            , "Create devices in length-prefixed record mode (default: false)");
+
+module_param(pow2_size, bool, S_IRUGO);
+MODULE_PARM_DESC(pow2_size
+            , "Round buffer sizes up to a power of two so indices wrap by mask (default: false)");
+
+module_param(hugepages, bool, S_IRUGO);
+MODULE_PARM_DESC(hugepages
+            , "Map buffers of 2 MB and more with huge pages in the kernel to cut TLB misses on copies (default: false)");
+
+module_param(telemetry_ms, int, S_IRUGO);
+MODULE_PARM_DESC(telemetry_ms
+            , "Refresh period of mmap'ed telemetry pages in ms, only while mapped (default: 10)");
+
+module_param(handoff_min, uint, S_IRUGO);
+MODULE_PARM_DESC(handoff_min
+            , "Smallest read(2) and write(2) in bytes copied straight from writer to a reader sleeping on an empty buffer, 0 disables (default: PAGE_SIZE)");
+
+module_param_array(numa_node, int, &numa_node_count, S_IRUGO);
+MODULE_PARM_DESC(numa_node
+            , "NUMA node of each device's buffer, comma-separated by minor; -1 or missing means any node");
+
+// Под-кольцо одного CPU в режиме SCULL_MODE_PERCPU - срез основного буфера.
+// Писатели пишут в под-кольцо своего CPU под его мьютексом, который почти
+// никогда не конкурирует; читатель под read_lock обходит все под-кольца
+struct scull_subring {
+    struct scull_ring ring;
+    struct mutex lock;              // Писатели, попавшие на этот CPU
+    __u32 head ____cacheline_aligned_in_smp;
+    __u32 tail ____cacheline_aligned_in_smp;
+};
+
+// Число ячеек log2-гистограмм: ячейка fls(v) - значения [2^(i-1), 2^i), 0 - ноль
+#define SCULL_HIST_BUCKETS 33
+
+// Статистика устройства. Счетчики свои у каждого CPU и меняются через
+// this_cpu_*: без атомиков и общих строк кэша, поэтому всегда включены.
+// Суммируются только при чтении файлов debugfs
+struct scull_stats {
+    u64 read_bytes;
+    u64 read_ops;
+    u64 write_bytes;
+    u64 write_ops;
+    u64 read_sleeps;                // Сколько раз читатель ждал данных
+    u64 write_sleeps;               // Сколько раз писатель ждал места
+    u64 read_eagain;                // Сколько раз чтение вернуло -EAGAIN
+    u64 write_eagain;
+    u64 read_wakeups;               // Сколько раз будили очередь читателей
+    u64 write_wakeups;
+    u64 read_retries;               // Чтения, повторенные из-за перезаписи
+    u64 read_handoffs;              // Пробуждения, переданные читателем следующему
+    u64 direct_bytes;               // Передано писателем прямо в буфер читателя
+    u64 forward_bytes;              // Перенесено по связи в другое устройство
+    u64 read_wait_us[SCULL_HIST_BUCKETS];   // Время ожидания данных
+    u64 write_wait_us[SCULL_HIST_BUCKETS];  // Время ожидания места
+    u64 read_size[SCULL_HIST_BUCKETS];      // Байт за один вызов чтения
+    u64 write_size[SCULL_HIST_BUCKETS];     // Байт за один вызов записи
+    u64 write_fill[SCULL_HIST_BUCKETS];     // Заполненность кольца после записи
+    u64 residency_us[SCULL_HIST_BUCKETS];   // Время записи в кольце (SCULL_MODE_TIMESTAMP)
+};
+
+// Страница телеметрии живет отдельно от устройства. Ее отображение держит не
+// файл устройства, а свой anon-файл со ссылкой только на эту структуру: монитор,
+// отобразивший страницу, не мешает удалить устройство через /dev/scull_ctl
+struct scull_telemetry_page {
+    struct kref ref;
+    struct scull_telemetry *page;
+    atomic_t maps;                  // Сколько отображений страницы
+};
+
 // Структура устройства
 struct scull_ring_buffer {
-    struct cdev cdev;               // Структура символьного устройства
+    // Структура символьного устройства. Выделяется отдельно (cdev_alloc):
+    // open(2), начавшийся до удаления устройства, держит ссылку на cdev, а не на нас
+    struct cdev *cdev;
+    // Ссылки: одна у таблицы devices, по одной у каждого открытого файла
+    // (отображение через mmap держит файл). Последняя освобождает устройство
+    struct kref ref;
+    struct dentry *debugfs;         // Каталог статистики устройства
     dev_t devno;                    // Номер устройства (major + minor)
-    char *buffer;                   // Указатель на кольцевой буфер в памяти ядра
-    int read_index;             
-    int write_index;            
-    int data_size;                  // Текущее количество данных в буфере
-    int size;                   
-    struct mutex lock;              // Мьютекс для защиты от гонок данных
+    struct scull_ring_ctrl *ctrl;   // Страница управления с head/tail, общая с user space
+    struct scull_ring ring;         // Основное кольцо, позиции в ctrl
+    struct scull_subring __percpu *subrings; // Под-кольца режима SCULL_MODE_PERCPU
+    unsigned int drain_cpu;         // С какого под-кольца читатель начнет следующий обход
+    u32 mode;                       // Флаги SCULL_MODE_*, меняются только на пустом буфере
+    struct mutex lock;              // Мьютекс для служебных операций (ioctl)
+    // Читатель меняет только tail, писатель только head, поэтому чтение и
+    // запись идут параллельно. Мьютексы сторон упорядочивают лишь читателей
+    // между собой и писателей между собой; для одной пары продюсер/консюмер
+    // они никогда не конкурируют
+    struct mutex read_lock;
+    struct mutex write_lock;
+    spinlock_t waiters_lock;        // Защищает счетчики спящих в ctrl
+    struct mutex map_lock;          // Упорядочивает mmap и замену буфера
+    atomic_t mmap_count;            // Сколько отображений буфера существует
     wait_queue_head_t read_queue;   // Очередь ожидания для процессов чтения
     wait_queue_head_t write_queue;  // Очередь ожидания для процессов записи
+    // Пороги пробуждения (SCULL_IOC_SET_WMARK), читаются без блокировок
+    u32 read_wmark;                 // Будить читателей с этого заполнения
+    u32 write_wmark;                // Будить писателей с этого свободного места
+    unsigned long wake_timeout;     // Через сколько jiffies будить читателей ниже порога
+    struct delayed_work read_flush; // Отложенное пробуждение читателей
+    struct scull_stats __percpu *stats;
+    int node;                       // NUMA-узел буфера или NUMA_NO_NODE
+    // Режим SCULL_MODE_OVERWRITE: писатель сдвигает tail сам. overruns
+    // растет перед каждым таким сдвигом, как счетчик seqcount: читатель,
+    // увидевший его изменение за время копирования, повторяет чтение
+    atomic_t overruns;
+    atomic64_t dropped;             // Сколько байт выброшено непрочитанными
+    // Связь SCULL_IOC_LINK: данные переносятся в приемник link внутри
+    // драйвера. link меняется под write_lock приемника и read_lock источника
+    // - теми же мьютексами, что держит перенос, - и держит ссылку на приемник
+    struct scull_ring_buffer *link;
+    struct scull_ring_buffer *link_src; // Источник, переносящий данные к нам
+    spinlock_t link_lock;           // Защищает link_src от разрыва связи
+    struct work_struct forward;     // Перенос данных в link
+    // Асинхронные уведомления о готовности: SIGIO (O_ASYNC) и eventfd
+    // (SCULL_IOC_SET_EVENTFD). Подписки меняются под lock
+    struct fasync_struct *async_queue;
+    struct eventfd_ctx *read_efd;   // Сигналит, когда появились данные
+    struct eventfd_ctx *write_efd;  // Сигналит, когда появилось место
+    struct file *read_efd_owner;    // Файл, зарегистрировавший eventfd:
+    struct file *write_efd_owner;   // регистрация снимается при его закрытии
+    spinlock_t async_lock;
+    __poll_t async_mask;            // Готовность при последнем уведомлении, под async_lock
+    u32 async_write_need;           // Запись, получившая EAGAIN, под async_lock
+    // Режим и размер кольца меняются под status_lock (и мьютексами сторон):
+    // SCULL_IOC_STATUS читает их без мьютексов, не мешая чтению и записи
+    seqlock_t status_lock;
+    // Страница телеметрии (mmap по SCULL_TELEMETRY_OFFSET, только чтение).
+    // Обновляется работой telemetry_work, пока отображена, - горячий путь
+    // о ней не знает
+    struct scull_telemetry_page *telemetry;
+    struct delayed_work telemetry_work;
+    // Прямая передача: читатель, уснувший на пустом кольце, выставляет здесь
+    // закрепленные страницы своего буфера, писатель забирает их под
+    // handoff_lock и копирует данные туда, минуя кольцо
+    struct scull_handoff *handoff;
+    spinlock_t handoff_lock;
+};
+
+// Буфер спящего читателя для прямой передачи. Живет на его стеке: после
+// done писатель к нему не обращается
+struct scull_handoff {
+    struct page **pages;            // Закрепленные страницы буфера читателя
+    size_t offset;                  // Смещение начала буфера в первой странице
+    size_t len;                     // Сколько байт закреплено
+    size_t copied;                  // Сколько байт положил писатель (с заголовком записи)
+    struct task_struct *task;       // Читатель, которого будить
+    bool done;                      // Писатель закончил, публикуется release
 };
 
-// Динамический массив структур устройств
-static struct scull_ring_buffer *devices = NULL;
+// Устройства по minor: созданные при загрузке и через /dev/scull_ctl.
+// Таблица защищена scull_devices_lock. minor свободен, если ячейка пуста и
+// не занята в scull_minors_reserved - там отмечены создаваемые устройства,
+// память которых выделяется без мьютекса
+static struct scull_ring_buffer *devices[MAX_DEVICES];
+static DECLARE_BITMAP(scull_minors_reserved, MAX_DEVICES);
+static DEFINE_MUTEX(scull_devices_lock);
 static int major_num = 0;
 static struct class *scull_class = NULL;
+static struct dentry *scull_debugfs = NULL;
+
+// Объявления функций файловых операций
+static int scull_open(struct inode *inode, struct file *filp);
+static int scull_release(struct inode *inode, struct file *filp);
+static int scull_fasync(int fd, struct file *filp, int on);
+static ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static int scull_mmap(struct file *filp, struct vm_area_struct *vma);
+static __poll_t scull_poll(struct file *filp, poll_table *wait);
+static int scull_set_mode(struct scull_ring_buffer *dev, unsigned long mode);
+
+// Структура файловых операций - связывает системные вызовы с нашими функциями
+static struct file_operations scull_fops = {
+    .owner = THIS_MODULE,    
+    .open = scull_open,      
+    .release = scull_release, 
+    // read(2)/write(2) идут через read_iter/write_iter, readv/writev
+    // обрабатываются за один вызов, io_uring может вызывать их без потока-исполнителя
+    .read_iter = scull_read_iter,
+    .write_iter = scull_write_iter,
+    // splice(2) и sendfile(2) тоже идут через read_iter/write_iter, но с
+    // iov_iter над страницами канала: данные копируются между кольцом и
+    // страницами канала один раз в ядре, минуя буфер пользователя. Отдавать
+    // в канал ссылки на страницы самого кольца нельзя - после сдвига tail
+    // писатель перезапишет их раньше, чем потребитель канала их прочтет
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
+    .unlocked_ioctl = scull_ioctl,
+    .mmap = scull_mmap,
+    .poll = scull_poll,
+    .fasync = scull_fasync
+};
+
+#define scull_stat_inc(dev, field) this_cpu_inc((dev)->stats->field)
+#define scull_stat_add(dev, field, n) this_cpu_add((dev)->stats->field, (n))
+// Значение попадает в ячейку fls(v) log2-гистограммы
+#define scull_stat_hist(dev, hist, v) this_cpu_inc((dev)->stats->hist[fls(v)])
+
+// Копирование len байт кольца начиная с pos в iov_iter (в две части, если
+// данные переходят через конец буфера). Возвращает, сколько скопировано
+static size_t scull_ring_to_iter(const struct scull_ring *ring, u32 pos, u32 len,
+                                 struct iov_iter *to)
+{
+    u32 first_part = scull_ring_first(ring, pos, len);
+    size_t copied;
+
+    copied = copy_to_iter(ring->buffer + scull_ring_index(ring, pos), first_part, to);
+    if (copied == first_part && len > first_part)
+        copied += copy_to_iter(ring->buffer, len - first_part, to);
+    return copied;
+}
+
+static size_t scull_ring_from_iter(struct scull_ring *ring, u32 pos, u32 len,
+                                   struct iov_iter *from)
+{
+    u32 first_part = scull_ring_first(ring, pos, len);
+    size_t copied;
+
+    copied = copy_from_iter(ring->buffer + scull_ring_index(ring, pos), first_part, from);
+    if (copied == first_part && len > first_part)
+        copied += copy_from_iter(ring->buffer, len - first_part, from);
+    return copied;
+}
+
+// Запись в кольцо из from: count байт или одна запись целиком. Вызывающий
+// держит мьютекс стороны писателя и уже проверил, что свободно space >= need.
+// stamp (только в режиме записей) кладется в начало данных записи
+static ssize_t scull_ring_put(struct scull_ring *ring, struct iov_iter *from,
+                              size_t count, u32 space, bool record, const __u64 *stamp)
+{
+    u32 head = scull_ring_load(ring, ring->head);
+    u32 extra = stamp ? sizeof(*stamp) : 0;
+    u32 pos, len;
+    size_t copied;
+
+    pos = scull_ring_put_begin(ring, head, count + extra, space, record, &len);
+    if (stamp) {
+        scull_ring_copy_in(ring, pos, stamp, extra);
+        pos = scull_ring_advance(ring, pos, extra);
+        len -= extra;
+    }
+    copied = scull_ring_from_iter(ring, pos, len, from);
+    // Половину записи не публикуем
+    if (copied == 0 || (record && copied != len)) {
+        iov_iter_revert(from, copied);
+        return -EFAULT;
+    }
+
+    // Публикуем новый head с учетом кольцевой структуры - читатель увидит
+    // данные не раньше, чем сам head
+    scull_ring_commit_head(ring, head, record ? sizeof(struct scull_record_hdr) + extra + copied : copied);
+    return copied;
+}
+
+// Время в очереди записи с меткой stamp, которую читатель забирает в now.
+// Время от mmap-продюсера проверить нельзя - берем только правдоподобное
+static void scull_stat_stamp(struct scull_ring_buffer *dev, __u64 stamp, u64 now)
+{
+    if (stamp <= now)
+        scull_stat_hist(dev, residency_us, min_t(u64, div_u64(now - stamp, NSEC_PER_USEC), U32_MAX));
+}
+
+// Режим SCULL_MODE_TIMESTAMP: сколько пролежала в кольце каждая из записей
+// [tail, tail + len), которые сейчас забирает читатель. Длины записей уже
+// проверены scull_ring_get_span
+static void scull_stat_residency(struct scull_ring_buffer *dev, const struct scull_ring *ring,
+                                 u32 tail, u32 len)
+{
+    u64 now = ktime_get_ns();
+    struct scull_record_hdr hdr;
+    __u64 stamp;
+    u32 off = 0;
+
+    while (off < len) {
+        scull_ring_copy_out(ring, scull_ring_advance(ring, tail, off), &hdr, sizeof(hdr));
+        if (hdr.len >= sizeof(stamp)) {
+            scull_ring_copy_out(ring, scull_ring_advance(ring, tail, off + sizeof(hdr)),
+                                &stamp, sizeof(stamp));
+            scull_stat_stamp(dev, stamp, now);
+        }
+        off += sizeof(hdr) + hdr.len;
+    }
+}
+
+// Чтение из кольца в to: до count байт или столько целых записей, сколько
+// помещается. 0 - читать пока нечего (в *need - сколько данных нужно ждать)
+static ssize_t scull_ring_get(struct scull_ring_buffer *dev, struct scull_ring *ring,
+                              struct iov_iter *to, size_t count, bool record, u32 *need)
+{
+    u32 tail = scull_ring_load(ring, ring->tail);
+    long bytes_to_read;
+    size_t copied;
+
+    bytes_to_read = scull_ring_get_span(ring, tail, count, record, need);
+    // Нечего читать, запись не помещается в буфер пользователя или кольцо испорчено
+    if (bytes_to_read <= 0)
+        return bytes_to_read;
+
+    copied = scull_ring_to_iter(ring, tail, bytes_to_read, to);
+
+    // Ошибка копирования: в потоковом режиме отдаем и извлекаем из буфера то,
+    // что успели скопировать; записи же не режем - откатываемся целиком
+    if (copied == 0 || (record && copied != bytes_to_read)) {
+        iov_iter_revert(to, copied);
+        return -EFAULT;
+    }
+
+    // Пока tail не сдвинут, писатели данные не тронут
+    if (record && (READ_ONCE(dev->mode) & SCULL_MODE_TIMESTAMP))
+        scull_stat_residency(dev, ring, tail, copied);
+
+    // Публикуем новый tail только после того, как данные скопированы
+    scull_ring_commit_tail(ring, tail, copied);
+    return copied;
+}
+
+// Режим перезаписи. Писатель (под write_lock) освобождает место, сдвигая
+// tail за старейшие байты или целые записи, и никогда не ждет. tail двигают
+// обе стороны, поэтому только через cmpxchg. Возвращает свободное место
+static u32 scull_drop_oldest(struct scull_ring_buffer *dev, u32 need, bool record)
+{
+    struct scull_ring *ring = &dev->ring;
+    u32 head = scull_ring_load(ring, ring->head);
+    u32 tail, used, drop;
+
+    // Читатель, копирующий сейчас старые данные, увидит смену счетчика:
+    // полный барьер упорядочивает его до сдвига tail и перезаписи данных
+    atomic_inc(&dev->overruns);
+    smp_mb__after_atomic();
+
+    do {
+        tail = scull_ring_load(ring, ring->tail);
+        used = scull_ring_used(ring, head, tail);
+        drop = 0;
+        if (!record) {
+            if (ring->size - used < need)
+                drop = need - (ring->size - used);
+        } else {
+            struct scull_record_hdr hdr;
+
+            // Заголовки пишет только писатель под тем же мьютексом
+            while (ring->size - used + drop < need && drop < used) {
+                scull_ring_copy_out(ring, scull_ring_advance(ring, tail, drop), &hdr, sizeof(hdr));
+                drop += min_t(u32, sizeof(hdr) + hdr.len, used - drop);
+            }
+        }
+        // Читатель успел освободить место сам
+        if (drop == 0)
+            return ring->size - used;
+    } while (cmpxchg(ring->tail, tail, scull_ring_advance(ring, tail, drop)) != tail);
+
+    atomic64_add(drop, &dev->dropped);
+    return ring->size - used + drop;
+}
+
+// Чтение в режиме перезаписи: как scull_ring_get, но данные могли быть
+// перезаписаны прямо во время копирования. Тогда откатываем iov_iter и
+// читаем заново с нового tail - читатель получает только целые данные
+static ssize_t scull_ring_get_lossy(struct scull_ring_buffer *dev, struct iov_iter *to,
+                                    size_t count, bool record, u32 *need)
+{
+    struct scull_ring *ring = &dev->ring;
+    long bytes_to_read;
+    size_t copied;
+    u32 tail;
+    int seq;
+
+    for (;;) {
+        seq = atomic_read(&dev->overruns);
+        smp_rmb();
+        tail = scull_ring_load(ring, ring->tail);
+        bytes_to_read = scull_ring_get_span(ring, tail, count, record, need);
+        copied = bytes_to_read > 0 ? scull_ring_to_iter(ring, tail, bytes_to_read, to) : 0;
+
+        // Пара к smp_mb__after_atomic в scull_drop_oldest
+        smp_rmb();
+        if (atomic_read(&dev->overruns) != seq) {
+            iov_iter_revert(to, copied);
+            scull_stat_inc(dev, read_retries);
+            continue;
+        }
+        if (bytes_to_read <= 0)
+            return bytes_to_read;
+        if (copied == 0 || (record && copied != bytes_to_read)) {
+            iov_iter_revert(to, copied);
+            return -EFAULT;
+        }
+        // Писатель мог сдвинуть tail уже после проверки - тогда его сдвиг
+        // главнее, а прочитанное могло быть перезаписано
+        if (cmpxchg(ring->tail, tail, scull_ring_advance(ring, tail, copied)) == tail)
+            return copied;
+        iov_iter_revert(to, copied);
+        scull_stat_inc(dev, read_retries);
+    }
+}
+
+// Количество данных на устройстве: в основном кольце или сумма по под-кольцам
+static u32 scull_data_size(const struct scull_ring_buffer *dev)
+{
+    u32 data_size = 0;
+    int cpu;
+
+    if (!(READ_ONCE(dev->mode) & SCULL_MODE_PERCPU))
+        return scull_ring_data_size(&dev->ring);
+
+    for_each_possible_cpu(cpu)
+        data_size += scull_ring_data_size(&per_cpu_ptr(dev->subrings, cpu)->ring);
+    return data_size;
+}
+
+// Кольцо, в которое пишет писатель на текущем CPU: в режиме под-колец -
+// под-кольцо этого CPU, иначе основное
+static const struct scull_ring *scull_write_ring(const struct scull_ring_buffer *dev)
+{
+    if (READ_ONCE(dev->mode) & SCULL_MODE_PERCPU)
+        return &per_cpu_ptr(dev->subrings, raw_smp_processor_id())->ring;
+    return &dev->ring;
+}
+
+// Свободное место для писателя на текущем CPU
+static u32 scull_space(const struct scull_ring_buffer *dev)
+{
+    const struct scull_ring *ring = scull_write_ring(dev);
+
+    return ring->size - scull_ring_data_size(ring);
+}
+
+// Сколько данных помещается на устройство: в режиме под-колец - срезы
+// возможных CPU, остальная часть буфера не используется (scull_carve_subrings)
+static u32 scull_capacity(const struct scull_ring_buffer *dev)
+{
+    if (READ_ONCE(dev->mode) & SCULL_MODE_PERCPU)
+        return num_possible_cpus() * scull_write_ring(dev)->size;
+    return READ_ONCE(dev->ring.size);
+}
+
+// Сколько свободного места в ring делает устройство готовым к записи: порог
+// write_wmark, в режиме записей - не меньше заголовка и байта данных. Иначе
+// poll сообщал бы EPOLLOUT при одном свободном байте, а write(2) записи
+// возвращал бы EAGAIN, и писатель на poll крутился бы вхолостую
+static u32 scull_write_need(const struct scull_ring_buffer *dev, const struct scull_ring *ring)
+{
+    u32 need = READ_ONCE(dev->write_wmark);
+
+    if (READ_ONCE(dev->mode) & SCULL_MODE_RECORD)
+        need = max_t(u32, need, sizeof(struct scull_record_hdr) + 1);
+    return min(need, ring->size);
+}
+
+// Готовность устройства, как ее видит poll(2)
+static __poll_t scull_poll_mask(const struct scull_ring_buffer *dev)
+{
+    const struct scull_ring *ring = scull_write_ring(dev);
+    __poll_t mask = 0;
+
+    if (scull_data_size(dev) > 0)
+        mask |= EPOLLIN | EPOLLRDNORM;  // Есть что читать
+    // В режиме перезаписи писать можно всегда
+    if (ring->size - scull_ring_data_size(ring) >= scull_write_need(dev, ring) ||
+        (READ_ONCE(dev->mode) & SCULL_MODE_OVERWRITE))
+        mask |= EPOLLOUT | EPOLLWRNORM; // Есть куда писать
+    return mask;
+}
+
+static bool scull_async_listeners(const struct scull_ring_buffer *dev)
+{
+    return READ_ONCE(dev->async_queue) || READ_ONCE(dev->read_efd) || READ_ONCE(dev->write_efd);
+}
+
+static void scull_eventfd_signal(struct eventfd_ctx *efd)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+    eventfd_signal(efd);
+#else
+    eventfd_signal(efd, 1);
+#endif
+}
+
+// Есть ли в ring место для писателя, ждущего асинхронного уведомления: как
+// у poll, но не меньше записи, на которой писатель получил EAGAIN
+static bool scull_async_ring_writable(const struct scull_ring_buffer *dev,
+                                      const struct scull_ring *ring)
+{
+    u32 need = max(scull_write_need(dev, ring), dev->async_write_need);
+
+    return ring->size - scull_ring_data_size(ring) >= min(need, ring->size);
+}
+
+// Готовность для асинхронных уведомлений (под async_lock). Уведомление
+// посылает тот, кто освободил место, а писать будет подписчик на другом
+// CPU, поэтому в режиме под-колец место нужно в каждом под-кольце
+static __poll_t scull_async_poll_mask(const struct scull_ring_buffer *dev)
+{
+    __poll_t mask = 0;
+    int cpu;
+
+    if (scull_data_size(dev) > 0)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (READ_ONCE(dev->mode) & SCULL_MODE_OVERWRITE)
+        return mask | EPOLLOUT | EPOLLWRNORM;
+
+    if (!(READ_ONCE(dev->mode) & SCULL_MODE_PERCPU)) {
+        if (scull_async_ring_writable(dev, &dev->ring))
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        return mask;
+    }
+    for_each_possible_cpu(cpu)
+        if (!scull_async_ring_writable(dev, &per_cpu_ptr(dev->subrings, cpu)->ring))
+            return mask;
+    return mask | EPOLLOUT | EPOLLWRNORM;
+}
+
+// Асинхронные уведомления: SIGIO и eventfd получают только фронт - переход
+// из "не готово" в "готово", поэтому после сигнала читать (писать) нужно до
+// EAGAIN. Вызывается после публикации head или tail и полного барьера.
+// Готовность считается под async_lock: кто возьмет его последним, тот
+// увидит все опубликованное до него
+static void scull_notify_async(struct scull_ring_buffer *dev)
+{
+    __poll_t mask, rising;
+
+    if (!scull_async_listeners(dev))
+        return;
+
+    spin_lock(&dev->async_lock);
+    mask = scull_async_poll_mask(dev);
+    rising = mask & ~dev->async_mask;
+    dev->async_mask = mask;
+    // Место под отложенную запись появилось - дальше ждем обычного порога
+    if (rising & EPOLLOUT)
+        dev->async_write_need = 0;
+    if ((rising & EPOLLIN) && dev->read_efd)
+        scull_eventfd_signal(dev->read_efd);
+    if ((rising & EPOLLOUT) && dev->write_efd)
+        scull_eventfd_signal(dev->write_efd);
+    spin_unlock(&dev->async_lock);
+
+    if (rising & EPOLLIN)
+        kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+    if (rising & EPOLLOUT)
+        kill_fasync(&dev->async_queue, SIGIO, POLL_OUT);
+}
+
+// Новая подписка (под lock). Пока подписчиков не было, async_mask не
+// обновлялся - отсчитываем фронты от текущего состояния. Для событий events
+// новый eventfd получит сигнал сразу, если устройство уже готово
+static void scull_async_arm(struct scull_ring_buffer *dev, bool had_listeners, __poll_t events)
+{
+    // Пара к барьеру писателя перед проверкой подписчиков
+    smp_mb();
+    spin_lock(&dev->async_lock);
+    if (!had_listeners) {
+        dev->async_write_need = 0;
+        dev->async_mask = scull_async_poll_mask(dev);
+    }
+    dev->async_mask &= ~events;
+    spin_unlock(&dev->async_lock);
+
+    if (events)
+        scull_notify_async(dev);
+}
+
+// Неблокирующий писатель получил EAGAIN, ожидая need байт. Устройство для
+// подписчиков могло остаться "готовым" (место есть, но не под эту запись
+// или не в под-кольце этого CPU) - тогда фронта больше не будет. Снимаем
+// EPOLLOUT и ждем места под запись: фронт придет, когда оно появится
+static void scull_async_rearm_write(struct scull_ring_buffer *dev, u32 need)
+{
+    if (!scull_async_listeners(dev))
+        return;
+
+    spin_lock(&dev->async_lock);
+    dev->async_write_need = max(dev->async_write_need, need);
+    dev->async_mask &= ~(EPOLLOUT | EPOLLWRNORM);
+    spin_unlock(&dev->async_lock);
+
+    // Читатель мог освободить место между проверкой и снятием EPOLLOUT
+    smp_mb();
+    scull_notify_async(dev);
+}
+
+// Связь между устройствами: в источнике появились данные или в приемнике
+// освободилось место - запускаем перенос. link_src читаем под link_lock:
+// после разрыва связи источник может быть уже освобожден
+static void scull_link_kick(struct scull_ring_buffer *dev)
+{
+    if (READ_ONCE(dev->link))
+        schedule_work(&dev->forward);
+    if (READ_ONCE(dev->link_src)) {
+        spin_lock(&dev->link_lock);
+        if (dev->link_src)
+            schedule_work(&dev->link_src->forward);
+        spin_unlock(&dev->link_lock);
+    }
+}
+
+// Будим читателей после записи. Пока данных меньше порога, не будим никого,
+// а только взводим отложенное пробуждение: мелкие записи копятся, и читатель
+// забирает их одним вызовом вместо того, чтобы просыпаться ради каждой
+static void scull_wake_readers(struct scull_ring_buffer *dev)
+{
+    unsigned long timeout;
+    bool sleepers;
+
+    scull_link_kick(dev);
+
+    // Содержит полный барьер: парный к set_current_state в wait_event и к
+    // регистрации асинхронных подписчиков
+    sleepers = wq_has_sleeper(&dev->read_queue);
+    scull_notify_async(dev);
+    if (!sleepers)
+        return;
+
+    if (scull_data_size(dev) >= min(READ_ONCE(dev->read_wmark), scull_capacity(dev))) {
+        scull_stat_inc(dev, read_wakeups);
+        wake_up_interruptible_poll(&dev->read_queue, EPOLLIN | EPOLLRDNORM);
+        return;
+    }
+
+    // Если таймер уже взведен, не переносим его: таймаут отсчитывается от
+    // первой записи, которую читатель еще не видел
+    timeout = READ_ONCE(dev->wake_timeout);
+    if (timeout)
+        schedule_delayed_work(&dev->read_flush, timeout);
+}
+
+static void scull_read_flush(struct work_struct *work)
+{
+    struct scull_ring_buffer *dev = container_of(to_delayed_work(work),
+                                                 struct scull_ring_buffer, read_flush);
+
+    scull_stat_inc(dev, read_wakeups);
+    wake_up_interruptible_poll(&dev->read_queue, EPOLLIN | EPOLLRDNORM);
+}
+
+// Будим писателей после чтения, только если освободилось write_wmark байт
+static void scull_wake_writers(struct scull_ring_buffer *dev)
+{
+    u32 capacity = scull_capacity(dev);
+    bool sleepers;
+
+    scull_link_kick(dev);
+
+    sleepers = wq_has_sleeper(&dev->write_queue);
+    scull_notify_async(dev);
+    if (!sleepers)
+        return;
+
+    if (capacity - min(scull_data_size(dev), capacity) >=
+        min3(READ_ONCE(dev->write_wmark), scull_write_ring(dev)->size, capacity)) {
+        scull_stat_inc(dev, write_wakeups);
+        wake_up_interruptible_poll(&dev->write_queue, EPOLLOUT | EPOLLWRNORM);
+    }
+}
+
+// Учет спящих процессов в странице управления: mmap-клиенты смотрят на эти
+// счетчики и вызывают SCULL_IOC_NOTIFY только если кто-то действительно спит
+static void scull_waiters_add(struct scull_ring_buffer *dev, __u32 *waiters, int delta)
+{
+    spin_lock(&dev->waiters_lock);
+    WRITE_ONCE(*waiters, READ_ONCE(*waiters) + delta);
+    spin_unlock(&dev->waiters_lock);
+}
+
+// Сколько микросекунд прошло с start (для гистограмм времени ожидания)
+static u32 scull_wait_us(u64 start)
+{
+    return min_t(u64, div_u64(ktime_get_ns() - start, NSEC_PER_USEC), U32_MAX);
+}
+
+// Условие пробуждения читателя: в буфере есть min байт или кольцо стало
+// меньше min (после смены размера) и ждать бессмысленно
+static bool scull_data_ready(const struct scull_ring_buffer *dev, u32 min)
+{
+    return scull_data_size(dev) >= min || READ_ONCE(dev->ring.size) < min;
+}
+
+// Писатель положил данные прямо в буфер читателя
+static bool scull_handoff_done(const struct scull_handoff *h)
+{
+    return h && smp_load_acquire(&h->done);
+}
+
+// Усыпляем процесс, пока в буфере не окажется хотя бы min байт или пока
+// писатель не заполнит выставленный буфер h. exclusive - read(2) в режиме
+// SCULL_MODE_WORKQUEUE: пробуждение достается одному читателю. Такой
+// читатель просыпается и при выходе устройства из режима, чтобы дальше ждать
+// как все
+static int scull_wait_data(struct scull_ring_buffer *dev, u32 min, bool exclusive,
+                           const struct scull_handoff *h)
+{
+    u64 start;
+    int ret;
+
+    trace_scull_sleep(MINOR(dev->devno), false, scull_data_size(dev));
+
+    // Освобожденное место могло остаться ниже порога писателей. Если ждать
+    // его будут и они, никто никого не разбудит - отдаем его сейчас
+    if (wq_has_sleeper(&dev->write_queue)) {
+        scull_stat_inc(dev, write_wakeups);
+        wake_up_interruptible_poll(&dev->write_queue, EPOLLOUT | EPOLLWRNORM);
+    }
+
+    scull_stat_inc(dev, read_sleeps);
+    start = ktime_get_ns();
+
+    scull_waiters_add(dev, &dev->ctrl->read_waiters, 1);
+    // Пара к барьеру продюсера между публикацией head и чтением read_waiters
+    smp_mb();
+    // Если буфер уменьшили так, что min в него уже не помещается, тоже
+    // просыпаемся: вызывающий перепроверит свои условия
+    if (exclusive)
+        ret = wait_event_interruptible_exclusive(dev->read_queue,
+                    scull_data_ready(dev, min) || scull_handoff_done(h) ||
+                    !(READ_ONCE(dev->mode) & SCULL_MODE_WORKQUEUE));
+    else
+        ret = wait_event_interruptible(dev->read_queue,
+                    scull_data_ready(dev, min) || scull_handoff_done(h));
+    scull_waiters_add(dev, &dev->ctrl->read_waiters, -1);
+
+    scull_stat_hist(dev, read_wait_us, scull_wait_us(start));
+
+    if (!ret)
+        trace_scull_wake(MINOR(dev->devno), false, scull_data_size(dev));
+    return ret;
+}
+
+// Прямая передача возможна, только пока все данные идут через write(2) в
+// основное кольцо: в режимах под-колец и перезаписи, со связью и при mmap
+// данные появляются в обход писателя, и порядок потока бы нарушился
+static bool scull_handoff_allowed(const struct scull_ring_buffer *dev, size_t count)
+{
+    u32 min = READ_ONCE(handoff_min);
+
+    return min && count >= min &&
+           !(READ_ONCE(dev->mode) & (SCULL_MODE_PERCPU | SCULL_MODE_OVERWRITE)) &&
+           !READ_ONCE(dev->link) && !atomic_read(&dev->mmap_count);
+}
+
+// Ожидание данных читателем, который мог бы получить их напрямую: закрепляем
+// страницы его буфера (до SCULL_HANDOFF_PAGES) и выставляем их писателям.
+// Писатель на пустом кольце копирует данные туда сам - одно копирование
+// вместо двух через кольцо. Возвращает, сколько байт получено напрямую
+// (to уже сдвинут на них), 0 - данные пришли в кольцо или ждать дальше не
+// нужно, -ERESTARTSYS - сигнал
+static ssize_t scull_handoff_wait(struct scull_ring_buffer *dev, struct iov_iter *to,
+                                  size_t count, u32 need, bool exclusive)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    struct page *pages[SCULL_HANDOFF_PAGES], **p = pages;
+    struct scull_handoff h = { .pages = pages, .task = current };
+    bool published, claimed;
+    ssize_t len;
+    int ret = 0;
+
+    // Страницы ядра (kvec, bvec) писателю ничего не дают: копирований столько же
+    if (!scull_handoff_allowed(dev, count) || !user_backed_iter(to) || READ_ONCE(dev->handoff))
+        return scull_wait_data(dev, need, exclusive, NULL);
+
+    len = iov_iter_extract_pages(to, &p, count, SCULL_HANDOFF_PAGES, 0, &h.offset);
+    if (len <= 0)
+        return scull_wait_data(dev, need, exclusive, NULL);
+    h.len = len;
+
+    // Выставлять можно только один буфер: остальные читатели ждут как обычно
+    spin_lock(&dev->handoff_lock);
+    published = !dev->handoff;
+    if (published)
+        dev->handoff = &h;
+    spin_unlock(&dev->handoff_lock);
+
+    if (published) {
+        ret = scull_wait_data(dev, need, exclusive, &h);
+
+        // Проснулись из-за данных в кольце или сигнала - забираем буфер
+        // обратно. Если писатель успел его взять, ждем, пока он закончит
+        // копирование в наши страницы, даже при сигнале
+        spin_lock(&dev->handoff_lock);
+        claimed = dev->handoff != &h;
+        if (!claimed)
+            dev->handoff = NULL;
+        spin_unlock(&dev->handoff_lock);
+        if (claimed)
+            wait_event(dev->read_queue, scull_handoff_done(&h));
+    }
+
+    if (iov_iter_extract_will_pin(to))
+        unpin_user_pages_dirty_lock(pages, DIV_ROUND_UP(h.offset + h.len, PAGE_SIZE), h.copied > 0);
+    iov_iter_revert(to, h.len - h.copied);
+    if (h.copied)
+        return h.copied;
+    return published ? ret : scull_wait_data(dev, need, exclusive, NULL);
+#else
+    return scull_wait_data(dev, need, exclusive, NULL);
+#endif
+}
+
+// Писатель под write_lock на пустом кольце: забираем выставленный буфер
+// читателя, если в него помещается need байт
+static struct scull_handoff *scull_handoff_claim(struct scull_ring_buffer *dev, size_t need)
+{
+    struct scull_handoff *h;
+
+    spin_lock(&dev->handoff_lock);
+    h = dev->handoff;
+    if (h && h->len >= need)
+        dev->handoff = NULL;
+    else
+        h = NULL;
+    spin_unlock(&dev->handoff_lock);
+    return h;
+}
+
+// Копирование в страницы буфера читателя, начиная с pos байт от его начала
+static void scull_handoff_copy_in(struct scull_handoff *h, size_t pos, const void *src, size_t len)
+{
+    size_t off, chunk;
+
+    while (len) {
+        off = h->offset + pos;
+        chunk = min_t(size_t, len, PAGE_SIZE - offset_in_page(off));
+        memcpy_to_page(h->pages[off / PAGE_SIZE], offset_in_page(off), src, chunk);
+        src = (const char *)src + chunk;
+        pos += chunk;
+        len -= chunk;
+    }
+}
+
+static size_t scull_handoff_from_iter(struct scull_handoff *h, size_t pos, size_t len,
+                                      struct iov_iter *from)
+{
+    size_t copied = 0, off, chunk, n;
+
+    while (copied < len) {
+        off = h->offset + pos + copied;
+        chunk = min_t(size_t, len - copied, PAGE_SIZE - offset_in_page(off));
+        n = copy_page_from_iter(h->pages[off / PAGE_SIZE], offset_in_page(off), chunk, from);
+        copied += n;
+        if (n != chunk)
+            break;
+    }
+    return copied;
+}
+
+// Передача из from в буфер читателя h: в потоковом режиме - сколько
+// поместится, в режиме записей - запись целиком с заголовком (и меткой
+// времени stamp). Будит читателя. Возвращает, сколько байт данных передано
+static ssize_t scull_handoff_put(struct scull_ring_buffer *dev, struct scull_handoff *h,
+                                 struct iov_iter *from, size_t count, bool record,
+                                 const __u64 *stamp)
+{
+    struct task_struct *task = h->task;
+    size_t pos = 0, len = min(count, h->len);
+    size_t copied;
+
+    if (record) {
+        struct scull_record_hdr hdr = { .len = count + (stamp ? sizeof(*stamp) : 0) };
+
+        scull_handoff_copy_in(h, pos, &hdr, sizeof(hdr));
+        pos += sizeof(hdr);
+        if (stamp) {
+            scull_handoff_copy_in(h, pos, stamp, sizeof(*stamp));
+            pos += sizeof(*stamp);
+        }
+        len = count;
+    }
+
+    copied = scull_handoff_from_iter(h, pos, len, from);
+    // Половину записи читателю не отдаем: он увидит, что ничего не пришло
+    if (record && copied != len) {
+        iov_iter_revert(from, copied);
+        copied = 0;
+    }
+    h->copied = copied ? pos + copied : 0;
+    // Запись с меткой попадает к читателю сейчас, минуя кольцо: в гистограмму
+    // времени в очереди она идет так же, как прочитанная из кольца
+    if (stamp && copied)
+        scull_stat_stamp(dev, *stamp, ktime_get_ns());
+
+    // После done читатель может вернуться из read(2) и завершиться
+    get_task_struct(task);
+    smp_store_release(&h->done, true);
+    wake_up_process(task);
+    put_task_struct(task);
+
+    scull_stat_add(dev, direct_bytes, copied);
+    return copied ? copied : -EFAULT;
+}
+
+// Условие пробуждения писателя: на его CPU освободилось min байт или кольцо
+// стало меньше min (после смены размера или режима) и ждать бессмысленно
+static bool scull_space_ready(const struct scull_ring_buffer *dev, u32 min)
+{
+    const struct scull_ring *ring = scull_write_ring(dev);
+
+    return ring->size - scull_ring_data_size(ring) >= min || READ_ONCE(ring->size) < min;
+}
+
+// Усыпляем процесс, пока в буфере не освободится хотя бы min байт
+static int scull_wait_space(struct scull_ring_buffer *dev, u32 min)
+{
+    u64 start;
+    int ret;
+
+    trace_scull_sleep(MINOR(dev->devno), true, scull_data_size(dev));
+
+    // То же для данных ниже порога читателей: писатель больше ничего не
+    // добавит, пока не освободится место
+    if (wq_has_sleeper(&dev->read_queue)) {
+        scull_stat_inc(dev, read_wakeups);
+        wake_up_interruptible_poll(&dev->read_queue, EPOLLIN | EPOLLRDNORM);
+    }
+
+    scull_stat_inc(dev, write_sleeps);
+    start = ktime_get_ns();
+
+    scull_waiters_add(dev, &dev->ctrl->write_waiters, 1);
+    smp_mb();
+    ret = wait_event_interruptible(dev->write_queue, scull_space_ready(dev, min));
+    scull_waiters_add(dev, &dev->ctrl->write_waiters, -1);
+
+    scull_stat_hist(dev, write_wait_us, scull_wait_us(start));
+
+    if (!ret)
+        trace_scull_wake(MINOR(dev->devno), true, scull_data_size(dev));
+    return ret;
+}
+
+// Размер основного кольца. Позиции остаются в странице управления
+static void scull_set_ring(struct scull_ring_buffer *dev, char *buffer, u32 size)
+{
+    scull_ring_init(&dev->ring, buffer, size, &dev->ctrl->head, &dev->ctrl->tail);
+    WRITE_ONCE(dev->ctrl->size, size);
+}
+
+// Размер буфера с учетом параметра pow2_size
+static u32 scull_ring_size(unsigned long size)
+{
+    return pow2_size ? roundup_pow_of_two(size) : size;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+struct scull_huge_alloc {
+    unsigned long size;
+    void *buffer;
+};
+
+static long scull_vmalloc_huge(void *arg)
+{
+    struct scull_huge_alloc *req = arg;
+
+    req->buffer = vmalloc_huge(req->size, GFP_KERNEL | __GFP_ZERO);
+    return 0;
+}
+#endif
+
+// Буфер кольца. vmalloc собирает его из отдельных страниц, поэтому кольца в
+// сотни мегабайт не требуют непрерывной физической памяти. Страницы берем с
+// узла устройства, чтобы буфер лежал рядом с ядрами продюсера и консюмера.
+//
+// С hugepages буфер от 2 МБ отображается в ядре страницами PMD: копирование в
+// read/write идет почти без промахов TLB (если большие страницы не нашлись,
+// vmalloc молча берет обычные). vmalloc_huge не принимает узел, поэтому
+// выделяем из потока на CPU нужного узла - там страницы берутся локально.
+// Страницы такого буфера раздельные, и mmap отображает их так же, по 4 КБ
+static char *scull_buffer_alloc(int node, u32 size)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+    if (hugepages) {
+        struct scull_huge_alloc req = { .size = PAGE_ALIGN(size) };
+        unsigned int cpu = nr_cpu_ids;
+
+        if (node != NUMA_NO_NODE)
+            cpu = cpumask_any_and(cpumask_of_node(node), cpu_online_mask);
+        if (cpu < nr_cpu_ids)
+            work_on_cpu(cpu, scull_vmalloc_huge, &req);
+        else
+            scull_vmalloc_huge(&req);
+        return req.buffer;
+    }
+#endif
+    return vzalloc_node(PAGE_ALIGN(size), node);
+}
+
+static struct scull_telemetry_page *scull_telemetry_alloc(int node)
+{
+    struct scull_telemetry_page *tp;
+
+    BUILD_BUG_ON(sizeof(struct scull_telemetry) > PAGE_SIZE);
+    tp = kzalloc_node(sizeof(*tp), GFP_KERNEL, node);
+    if (!tp)
+        return NULL;
+    tp->page = vzalloc_node(PAGE_SIZE, node);
+    if (!tp->page) {
+        kfree(tp);
+        return NULL;
+    }
+    kref_init(&tp->ref);
+    atomic_set(&tp->maps, 0);
+    return tp;
+}
+
+static void scull_telemetry_release(struct kref *ref)
+{
+    struct scull_telemetry_page *tp = container_of(ref, struct scull_telemetry_page, ref);
+
+    vfree(tp->page);
+    kfree(tp);
+}
+
+static void scull_telemetry_put(struct scull_telemetry_page *tp)
+{
+    kref_put(&tp->ref, scull_telemetry_release);
+}
+
+// Устройство освобождено: страница больше не обновится. Отобразившие ее
+// мониторы видят SCULL_TELEMETRY_REMOVED и сами снимают отображение
+static void scull_telemetry_removed(struct scull_telemetry_page *tp)
+{
+    struct scull_telemetry *t = tp->page;
+
+    WRITE_ONCE(t->seq, t->seq + 1);
+    smp_wmb();
+    t->flags |= SCULL_TELEMETRY_REMOVED;
+    smp_wmb();
+    WRITE_ONCE(t->seq, t->seq + 1);
+}
+
+// Страница управления и буфер выделяются раздельно: страница живет все время
+// жизни устройства, а буфер можно заменить при изменении размера. Обе области
+// обнулены и отображаются в user space постранично
+static int scull_alloc_ring(struct scull_ring_buffer *dev, u32 size)
+{
+    char *buffer;
+    int cpu;
+
+    BUILD_BUG_ON(sizeof(struct scull_ring_ctrl) > PAGE_SIZE);
+
+    // head и tail читаются на каждой операции - тоже держим их на узле буфера
+    dev->ctrl = vzalloc_node(PAGE_SIZE, dev->node);
+    if (!dev->ctrl)
+        return -ENOMEM;
+
+    dev->telemetry = scull_telemetry_alloc(dev->node);
+    if (!dev->telemetry)
+        goto fail_telemetry;
+
+    buffer = scull_buffer_alloc(dev->node, size);
+    if (!buffer)
+        goto fail_buffer;
+
+    // Под-кольца небольшие и нужны только в режиме SCULL_MODE_PERCPU, но
+    // выделяем их сразу: писатели обращаются к ним без мьютекса устройства
+    dev->subrings = alloc_percpu(struct scull_subring);
+    if (!dev->subrings)
+        goto fail_subrings;
+    for_each_possible_cpu(cpu)
+        mutex_init(&per_cpu_ptr(dev->subrings, cpu)->lock);
+
+    dev->stats = alloc_percpu(struct scull_stats);
+    if (!dev->stats)
+        goto fail_stats;
+
+    scull_set_ring(dev, buffer, size);
+    dev->ctrl->data_offset = PAGE_SIZE;
+    return 0;
+
+fail_stats:
+    free_percpu(dev->subrings);
+fail_subrings:
+    vfree(buffer);
+fail_buffer:
+    scull_telemetry_put(dev->telemetry);
+fail_telemetry:
+    vfree(dev->ctrl);
+    return -ENOMEM;
+}
+
+static void scull_free_ring(struct scull_ring_buffer *dev)
+{
+    free_percpu(dev->stats);
+    free_percpu(dev->subrings);
+    vfree(dev->ring.buffer);
+    scull_telemetry_put(dev->telemetry);
+    vfree(dev->ctrl);
+}
+
+// Нарезаем основной буфер на под-кольца: срез на каждый номер CPU до
+// nr_cpu_ids, чтобы срез CPU лежал по его номеру, а под-кольца получают только
+// возможные CPU. Вызывается на пустом буфере, когда все писатели и читатели
+// остановлены
+static int scull_carve_subrings(struct scull_ring_buffer *dev)
+{
+    u32 slice = dev->ring.size / nr_cpu_ids;
+    int cpu;
+
+    // Маской можно пользоваться и в под-кольцах
+    if (dev->ring.mask && slice)
+        slice = rounddown_pow_of_two(slice);
+    if (slice < MIN_SUBRING_SIZE)
+        return -EINVAL;
+
+    for_each_possible_cpu(cpu) {
+        struct scull_subring *sub = per_cpu_ptr(dev->subrings, cpu);
+
+        sub->head = 0;
+        sub->tail = 0;
+        scull_ring_init(&sub->ring, dev->ring.buffer + cpu * slice, slice,
+                        &sub->head, &sub->tail);
+    }
+    return 0;
+}
+
+static void scull_dev_put(struct scull_ring_buffer *dev);
+
+// Перенос данных по связи: забираем из источника столько, сколько помещается
+// в приемник (в режиме записей - целыми записями), копированием из кольца в
+// кольцо. Перенос - читатель источника и писатель приемника, упорядочен с
+// остальными их мьютексами. Когда приемник полон, данные остаются в
+// источнике, и его писатели засыпают как обычно. Одна работа не выполняется
+// параллельно сама с собой
+static void scull_forward(struct work_struct *work)
+{
+    struct scull_ring_buffer *src = container_of(work, struct scull_ring_buffer, forward);
+    struct scull_ring_buffer *dst = READ_ONCE(src->link);
+    u32 head, tail, space, need;
+    u32 moved = 0;
+    long len;
+
+    // Приемник не освободится: разрыв связи дожидается этой работы
+    if (!dst)
+        return;
+
+    mutex_lock(&dst->write_lock);
+    mutex_lock(&src->read_lock);
+    if (src->link != dst)
+        goto out;
+
+    for (;;) {
+        head = scull_ring_load(&dst->ring, dst->ring.head);
+        tail = scull_ring_load(&src->ring, src->ring.tail);
+        space = dst->ring.size - scull_ring_data_size(&dst->ring);
+        // -EMSGSIZE - запись пока не помещается, подождем места в приемнике
+        len = scull_ring_get_span(&src->ring, tail, space, src->mode & SCULL_MODE_RECORD, &need);
+        if (len <= 0) {
+            if (len == -EIO)
+                pr_warn_ratelimited("scull_ring_buffer: Device %d: corrupted record, link stalled\n",
+                                    MINOR(src->devno));
+            break;
+        }
+        scull_ring_move(&dst->ring, head, &src->ring, tail, len);
+        scull_ring_commit_head(&dst->ring, head, len);
+        scull_ring_commit_tail(&src->ring, tail, len);
+        moved += len;
+    }
+
+out:
+    mutex_unlock(&src->read_lock);
+    mutex_unlock(&dst->write_lock);
+
+    if (moved) {
+        scull_stat_add(src, forward_bytes, moved);
+        scull_wake_readers(dst);
+        scull_wake_writers(src);
+    }
+}
+
+// Разрыв связи источника. Изменения связей упорядочены scull_devices_lock,
+// кроме освобождения источника: на него уже никто не ссылается
+static void scull_unlink(struct scull_ring_buffer *src)
+{
+    struct scull_ring_buffer *dst = src->link;
+
+    if (!dst)
+        return;
+
+    mutex_lock(&dst->write_lock);
+    mutex_lock(&src->read_lock);
+    WRITE_ONCE(src->link, NULL);
+    spin_lock(&dst->link_lock);
+    dst->link_src = NULL;
+    spin_unlock(&dst->link_lock);
+    mutex_unlock(&src->read_lock);
+    mutex_unlock(&dst->write_lock);
+
+    // Больше никто не запустит перенос - дожидаемся уже запущенного
+    cancel_work_sync(&src->forward);
+    scull_dev_put(dst);
+}
+
+// SCULL_IOC_LINK: связываем устройство с приемником minor (отрицательный -
+// разрываем связь). Вызывается под dev->lock
+static int scull_link(struct scull_ring_buffer *dev, long minor)
+{
+    struct scull_ring_buffer *dst, *p;
+    int retval = 0;
+
+    mutex_lock(&scull_devices_lock);
+
+    if (minor < 0) {
+        scull_unlink(dev);
+        goto out;
+    }
+
+    dst = minor < MAX_DEVICES ? devices[minor] : NULL;
+    if (!dst) {
+        retval = -ENODEV;
+        goto out;
+    }
+    // У источника один приемник, у приемника - один источник
+    if (dev->link || dst->link_src) {
+        retval = dev->link == dst ? 0 : -EBUSY;
+        goto out;
+    }
+    // Данные ходили бы по кругу
+    for (p = dst; p; p = p->link) {
+        if (p == dev) {
+            retval = -ELOOP;
+            goto out;
+        }
+    }
+
+    mutex_lock(&dst->write_lock);
+    mutex_lock(&dev->read_lock);
+
+    // Перенос пишет в основное кольцо приемника и сам сдвигает tail
+    // источника. Формат данных должен совпадать, а любая запись источника
+    // - помещаться в приемник
+    if (((dev->mode | dst->mode) & (SCULL_MODE_PERCPU | SCULL_MODE_OVERWRITE)) ||
+        ((dev->mode ^ dst->mode) & (SCULL_MODE_RECORD | SCULL_MODE_TIMESTAMP)) ||
+        ((dev->mode & SCULL_MODE_RECORD) && dst->ring.size < dev->ring.size)) {
+        retval = -EINVAL;
+    } else {
+        kref_get(&dst->ref);
+        WRITE_ONCE(dev->link, dst);
+        spin_lock(&dst->link_lock);
+        dst->link_src = dev;
+        spin_unlock(&dst->link_lock);
+    }
+
+    mutex_unlock(&dev->read_lock);
+    mutex_unlock(&dst->write_lock);
+
+    // В источнике уже могут лежать данные
+    if (!retval)
+        schedule_work(&dev->forward);
+
+out:
+    mutex_unlock(&scull_devices_lock);
+    return retval;
+}
+
+// Последняя ссылка: устройство уже убрано из таблицы, /dev и debugfs
+static void scull_dev_release(struct kref *ref)
+{
+    struct scull_ring_buffer *dev = container_of(ref, struct scull_ring_buffer, ref);
+
+    // Приемник связи держится нашей ссылкой - отпускаем
+    scull_unlink(dev);
+
+    // Отложенные работы обращаются к устройству - дожидаемся их. Страница
+    // телеметрии может быть еще отображена: помечаем ее, мониторы отпустят
+    cancel_delayed_work_sync(&dev->read_flush);
+    cancel_delayed_work_sync(&dev->telemetry_work);
+    scull_telemetry_removed(dev->telemetry);
+    // Освобождаем память буфера вместе со страницей управления
+    scull_free_ring(dev);
+    kfree(dev);
+}
+
+static void scull_dev_put(struct scull_ring_buffer *dev)
+{
+    kref_put(&dev->ref, scull_dev_release);
+}
+
+// Функция открытия устройства
+static int scull_open(struct inode *inode, struct file *filp)
+{
+    struct scull_ring_buffer *dev; 
+    int minor = iminor(inode); 
+
+    // Получаем устройство по minor номеру и ссылку на него: пока файл
+    // открыт, устройство не освобождается. Удаленного устройства в таблице
+    // уже нет, даже если узел в /dev еще открывают
+    mutex_lock(&scull_devices_lock);
+    dev = minor < MAX_DEVICES ? devices[minor] : NULL;
+    if (dev)
+        kref_get(&dev->ref);
+    mutex_unlock(&scull_devices_lock);
+    if (!dev)
+        return -ENODEV;
+
+    filp->private_data = dev;
+
+    // Устройство - поток без позиции; IOCB_NOWAIT поддерживается честно
+    stream_open(inode, filp);
+    filp->f_mode |= FMODE_NOWAIT;
+
+    // Отладочное сообщение: компилируется только с make SCULL_DEBUG=1
+    // или включается через dynamic debug
+    pr_debug("scull_ring_buffer: Device %d opened\n", minor);
+    return 0; // Успешное завершение
+}
+
+// Функция закрытия устройства
+static int scull_release(struct inode *inode, struct file *filp)
+{
+    struct scull_ring_buffer *dev = filp->private_data;
+    struct eventfd_ctx *read_efd = NULL, *write_efd = NULL;
+
+    pr_debug("scull_ring_buffer: Device %d closed\n", iminor(inode));
+
+    // Снимаем подписки этого файла на асинхронные уведомления
+    scull_fasync(-1, filp, 0);
+    mutex_lock(&dev->lock);
+    spin_lock(&dev->async_lock);
+    if (dev->read_efd_owner == filp) {
+        swap(read_efd, dev->read_efd);
+        dev->read_efd_owner = NULL;
+    }
+    if (dev->write_efd_owner == filp) {
+        swap(write_efd, dev->write_efd);
+        dev->write_efd_owner = NULL;
+    }
+    spin_unlock(&dev->async_lock);
+    mutex_unlock(&dev->lock);
+    if (read_efd)
+        eventfd_ctx_put(read_efd);
+    if (write_efd)
+        eventfd_ctx_put(write_efd);
+
+    scull_dev_put(dev);
+    return 0; // Успешное завершение
+}
+
+// O_ASYNC: SIGIO владельцу файла на фронтах готовности (POLL_IN / POLL_OUT)
+static int scull_fasync(int fd, struct file *filp, int on)
+{
+    struct scull_ring_buffer *dev = filp->private_data;
+    bool had_listeners;
+    int ret;
+
+    mutex_lock(&dev->lock);
+    had_listeners = scull_async_listeners(dev);
+    ret = fasync_helper(fd, filp, on, &dev->async_queue);
+    if (ret >= 0 && on)
+        scull_async_arm(dev, had_listeners, 0);
+    mutex_unlock(&dev->lock);
+    return ret;
+}
+
+// SCULL_IOC_SET_EVENTFD (под lock): eventfd для событий SCULL_EVENT_*
+// или снятие регистрации при fd = -1. Регистрация живет, пока открыт файл,
+// через который ее сделали
+static int scull_set_eventfd(struct scull_ring_buffer *dev, struct file *filp,
+                             const struct scull_eventfd *req)
+{
+    struct eventfd_ctx *efd = NULL, *efd2, *old_read = NULL, *old_write = NULL;
+    bool had_listeners = scull_async_listeners(dev);
+    __poll_t events = 0;
+
+    if (!req->events || (req->events & ~(SCULL_EVENT_READABLE | SCULL_EVENT_WRITABLE)))
+        return -EINVAL;
+
+    if (req->fd >= 0) {
+        efd = eventfd_ctx_fdget(req->fd);
+        if (IS_ERR(efd))
+            return PTR_ERR(efd);
+        // По ссылке на каждую из ячеек. fd могли заменить между вызовами
+        if ((req->events & SCULL_EVENT_READABLE) && (req->events & SCULL_EVENT_WRITABLE)) {
+            efd2 = eventfd_ctx_fdget(req->fd);
+            if (efd2 != efd) {
+                if (!IS_ERR(efd2))
+                    eventfd_ctx_put(efd2);
+                eventfd_ctx_put(efd);
+                return -EBADF;
+            }
+        }
+    } else if (req->fd != -1) {
+        return -EBADF;
+    }
+
+    spin_lock(&dev->async_lock);
+    if (req->events & SCULL_EVENT_READABLE) {
+        old_read = dev->read_efd;
+        dev->read_efd = efd;
+        dev->read_efd_owner = efd ? filp : NULL;
+        events |= EPOLLIN;
+    }
+    if (req->events & SCULL_EVENT_WRITABLE) {
+        old_write = dev->write_efd;
+        dev->write_efd = efd;
+        dev->write_efd_owner = efd ? filp : NULL;
+        events |= EPOLLOUT;
+    }
+    spin_unlock(&dev->async_lock);
+
+    if (old_read)
+        eventfd_ctx_put(old_read);
+    if (old_write)
+        eventfd_ctx_put(old_write);
+
+    if (efd)
+        scull_async_arm(dev, had_listeners, events);
+    return 0;
+}
+
+// Захват мьютекса стороны. С IOCB_NOWAIT (io_uring) спать нельзя даже на мьютексе
+static int scull_lock_side(struct mutex *lock, bool nowait)
+{
+    if (nowait)
+        return mutex_trylock(lock) ? 0 : -EAGAIN;
+    if (mutex_lock_interruptible(lock))
+        return -ERESTARTSYS;
+    return 0;
+}
+
+// Обход под-колец в режиме SCULL_MODE_PERCPU. Читатель держит read_lock и
+// забирает данные из под-колец по кругу, начиная с того, где остановился
+// прошлый обход, чтобы ни один CPU не голодал. Порядок сохраняется внутри
+// под-кольца: записи одного писателя идут в порядке записи, пока он не
+// сменит CPU; между разными под-кольцами порядка нет
+static ssize_t scull_drain_subrings(struct scull_ring_buffer *dev, struct iov_iter *to,
+                                    bool record)
+{
+    unsigned int start = dev->drain_cpu;
+    unsigned int n, cpu = start;
+    ssize_t total = 0;
+    ssize_t ret = 0;
+    bool too_big = false;       // Хоть одна запись не влезла в буфер пользователя
+    u32 need;
+
+    for (n = 0; n < nr_cpu_ids && iov_iter_count(to); n++) {
+        cpu = start + n;
+        if (cpu >= nr_cpu_ids)
+            cpu -= nr_cpu_ids;
+        if (!cpu_possible(cpu))
+            continue;
+
+        ret = scull_ring_get(dev, &per_cpu_ptr(dev->subrings, cpu)->ring, to,
+                             iov_iter_count(to), record, &need);
+        if (ret > 0)
+            total += ret;
+        // Запись этого CPU не влезла в остаток буфера - пробуем следующие
+        else if (ret == -EMSGSIZE)
+            too_big = true;
+        else if (ret < 0)
+            break;
+    }
+    dev->drain_cpu = cpu + 1 < nr_cpu_ids ? cpu + 1 : 0;
+
+    if (total)
+        return total;
+    if (ret < 0 && ret != -EMSGSIZE)
+        return ret;
+    // Последним могло оказаться пустое под-кольцо: без этого read(2) принял
+    // бы запись, которая не помещается, за отсутствие данных и ждал бы вечно
+    return too_big ? -EMSGSIZE : 0;
+}
+
+// Функция чтения из устройства. Заполняет все сегменты iovec за один захват
+// мьютекса и одно пробуждение писателей
+// Режим SCULL_MODE_WORKQUEUE: read(2) отдает не больше одной записи, поэтому
+// ограничиваем count длиной первой из них. Если ее заголовка еще нет, count
+// не трогаем - scull_ring_get сам вернет 0 и скажет, сколько ждать. Вызывается
+// под read_lock: tail никто, кроме нас, не сдвинет
+static size_t scull_first_record(const struct scull_ring *ring, size_t count)
+{
+    struct scull_record_hdr hdr;
+
+    if (scull_ring_data_size(ring) < sizeof(hdr))
+        return count;
+    scull_ring_copy_out(ring, scull_ring_load(ring, ring->tail), &hdr, sizeof(hdr));
+    return min_t(size_t, count, sizeof(hdr) + (size_t)hdr.len);
+}
+
+// Режим SCULL_MODE_WORKQUEUE: писатель разбудил одного читателя. Если после
+// чтения в кольце осталась работа, будим следующего - так просыпается
+// столько читателей, сколько есть данных, и пробуждение не теряется, даже
+// если данных пришло больше, чем было пробуждений
+static void scull_handoff_readers(struct scull_ring_buffer *dev)
+{
+    if (scull_data_size(dev) == 0 || !wq_has_sleeper(&dev->read_queue))
+        return;
+
+    scull_stat_inc(dev, read_handoffs);
+    wake_up_interruptible_poll(&dev->read_queue, EPOLLIN | EPOLLRDNORM);
+}
+
+static ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    struct scull_ring_buffer *dev = filp->private_data; // Получаем наше устройство
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    bool nonblock = nowait || (filp->f_flags & O_NONBLOCK);
+    size_t count = iov_iter_count(to);            // Сколько байт запрошено во всех сегментах
+    ssize_t retval;                                // Возвращаемое значение (количество прочитанных байт)
+    u32 need;                                      // Сколько данных нужно, чтобы было что читать
+    bool record;
+    bool workqueue;                                // Режим SCULL_MODE_WORKQUEUE
+
+    if (count == 0)
+        return 0;
+
+    retval = scull_lock_side(&dev->read_lock, nowait);
+    if (retval) {
+        if (retval == -EAGAIN)
+            scull_stat_inc(dev, read_eagain);
+        return retval;
+    }
+
+    // Ждем, пока в буфере появятся данные для чтения. В режиме записей - пока
+    // первая запись не окажется в буфере целиком
+    for (;;) {
+        // Режим меняется только под read_lock, поэтому читаем его здесь
+        record = dev->mode & SCULL_MODE_RECORD;
+        workqueue = dev->mode & SCULL_MODE_WORKQUEUE;
+        if (dev->mode & SCULL_MODE_PERCPU) {
+            retval = scull_drain_subrings(dev, to, record);
+            need = 1;
+        } else if (dev->mode & SCULL_MODE_OVERWRITE) {
+            retval = scull_ring_get_lossy(dev, to, count, record, &need);
+        } else {
+            retval = scull_ring_get(dev, &dev->ring, to,
+                                    workqueue && record ? scull_first_record(&dev->ring, count) : count,
+                                    record, &need);
+        }
+        if (retval != 0)
+            break;
+
+        mutex_unlock(&dev->read_lock);
+        // Проверяем, открыто ли устройство в неблокирующем режиме
+        if (nonblock) {
+            scull_stat_inc(dev, read_eagain);
+            return -EAGAIN;
+        }
+
+        // Усыпляем процесс в очереди чтения. Проснется когда в буфере появятся
+        // данные или когда писатель положит их прямо в наш буфер
+        retval = scull_handoff_wait(dev, to, count, need, workqueue);
+        if (retval > 0) {
+            if (trace_scull_read_enabled())
+                trace_scull_read(MINOR(dev->devno), retval, scull_data_size(dev), dev->ring.size);
+            scull_stat_inc(dev, read_ops);
+            scull_stat_add(dev, read_bytes, retval);
+            scull_stat_hist(dev, read_size, retval);
+            return retval;
+        }
+        if (retval)
+            return -ERESTARTSYS;
+
+        // Проснулись, снова пытаемся захватить мьютекс
+        if (mutex_lock_interruptible(&dev->read_lock))
+            return -ERESTARTSYS;
+    }
+
+    // Запись не помещается в буфер пользователя, ошибка копирования или кольцо испорчено
+    if (retval < 0)
+        goto out;
+
+    // Заполненность после чтения считаем только при включенной трассировке
+    if (trace_scull_read_enabled())
+        trace_scull_read(MINOR(dev->devno), retval, scull_data_size(dev), dev->ring.size);
+
+    mutex_unlock(&dev->read_lock);
+
+    scull_stat_inc(dev, read_ops);
+    scull_stat_add(dev, read_bytes, retval);
+    scull_stat_hist(dev, read_size, retval);
+
+    // Будим процессы, ждущие в очереди записи, если освободилось достаточно
+    // места. Мьютекс уже отпущен: проснувшимся писателям он не нужен, а
+    // следующий читатель не ждет wake_up
+    scull_wake_writers(dev);
+    if (workqueue)
+        scull_handoff_readers(dev);
+    return retval;
+
+// Метка выхода из функции при ошибке
+out:
+    mutex_unlock(&dev->read_lock);
+    // Запись не досталась нам (например, не поместилась в буфер) - ее
+    // пробуждение должен получить кто-то другой
+    if (workqueue)
+        scull_handoff_readers(dev);
+    return retval; 
+}
+
+// Функция записи в устройство. Собирает все сегменты iovec за один захват
+// мьютекса и одно пробуждение читателей.
+//
+// В обычном режиме писатели упорядочены write_lock. В режиме SCULL_MODE_PERCPU
+// писатель берет только мьютекс под-кольца своего CPU: смена режима захватывает
+// все эти мьютексы, поэтому под любым из них режим не меняется
+static ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *filp = iocb->ki_filp;
+    struct scull_ring_buffer *dev = filp->private_data; // Получаем наше устройство
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    bool nonblock = nowait || (filp->f_flags & O_NONBLOCK);
+    size_t count = iov_iter_count(from);
+    ssize_t retval;
+    struct scull_ring *ring;     // Кольцо, в которое пишем
+    struct mutex *lock;          // Мьютекс, под которым пишем в это кольцо
+    u32 space_available;         
+    long need;                   // Сколько места нужно, чтобы начать запись
+    u32 fill;                    // Заполненность после записи
+    bool percpu;
+    bool overwrite;
+    bool stamp;                  // Режим SCULL_MODE_TIMESTAMP
+    bool queued;                 // Что-то положено в кольцо, а не только читателю
+    __u64 now;
+
+    if (count == 0)
+        return 0;
+
+    for (;;) {
+        // Выбираем кольцо: под-кольцо текущего CPU или основное. Если после
+        // захвата мьютекса режим оказался другим - выбираем заново
+        percpu = READ_ONCE(dev->mode) & SCULL_MODE_PERCPU;
+        if (percpu) {
+            struct scull_subring *sub = per_cpu_ptr(dev->subrings, raw_smp_processor_id());
+
+            ring = &sub->ring;
+            lock = &sub->lock;
+        } else {
+            ring = &dev->ring;
+            lock = &dev->write_lock;
+        }
+
+        // Захватываем мьютекс
+        retval = scull_lock_side(lock, nowait);
+        if (retval) {
+            if (retval == -EAGAIN)
+                scull_stat_inc(dev, write_eagain);
+            return retval;
+        }
+        if (percpu != !!(dev->mode & SCULL_MODE_PERCPU)) {
+            mutex_unlock(lock);
+            continue;
+        }
+
+        // Запись в режиме записей принимается только целиком, вместе с
+        // заголовком и временем постановки в очередь
+        stamp = dev->mode & SCULL_MODE_TIMESTAMP;
+        need = scull_ring_need(ring, count + (stamp ? sizeof(now) : 0),
+                               dev->mode & SCULL_MODE_RECORD);
+        if (need < 0) {
+            retval = need;
+            goto out;
+        }
+
+        // В режиме перезаписи поток пишется сразу целиком (до размера кольца)
+        overwrite = !percpu && (dev->mode & SCULL_MODE_OVERWRITE);
+        if (overwrite && !(dev->mode & SCULL_MODE_RECORD))
+            need = min_t(size_t, count, ring->size);
+
+        // Вычисляем свободное место в буфере
+        space_available = ring->size - scull_ring_data_size(ring);
+        if (space_available >= need)
+            break;
+
+        // Писатель не ждет: место освобождается за счет старейших данных
+        if (overwrite) {
+            space_available = scull_drop_oldest(dev, need, dev->mode & SCULL_MODE_RECORD);
+            break;
+        }
+
+        mutex_unlock(lock);
+
+        // Проверяем, открыто ли устройство в неблокирующем режиме
+        if (nonblock) {
+            scull_stat_inc(dev, write_eagain);
+            scull_async_rearm_write(dev, need);
+            return -EAGAIN;
+        }
+
+        // Усыпляем процесс в очереди записи. Проснется когда появится место
+        if (scull_wait_space(dev, need))
+            return -ERESTARTSYS; // Было прерывание
+    }
+
+    // Время берем после ожидания места: в кольце запись с этого момента
+    now = ktime_get_ns();
+
+    // Читатель уснул на пустом кольце и выставил свой буфер: копируем прямо
+    // туда. Кольцо пусто, значит, более ранних данных нет и порядок не
+    // нарушится. Остаток потока, не поместившийся к читателю, идет в кольцо
+    retval = 0;
+    if (READ_ONCE(dev->handoff) && scull_ring_data_size(ring) == 0 &&
+        scull_handoff_allowed(dev, count)) {
+        struct scull_handoff *h = scull_handoff_claim(dev, need);
+
+        if (h) {
+            retval = scull_handoff_put(dev, h, from, count, dev->mode & SCULL_MODE_RECORD,
+                                       stamp ? &now : NULL);
+            if (retval < 0)
+                goto out;
+        }
+    }
+
+    queued = (size_t)retval < count;
+    if (queued) {
+        ssize_t put = scull_ring_put(ring, from, count - retval, space_available,
+                                     dev->mode & SCULL_MODE_RECORD, stamp ? &now : NULL);
+
+        // Часть потока уже у читателя - об ошибке скажет следующий write(2)
+        if (put < 0 && retval == 0) {
+            retval = put;
+            goto out;
+        }
+        if (put > 0)
+            retval += put;
+        else
+            queued = false;
+    }
+
+    // В режиме под-колец - заполненность под-кольца, в которое писали
+    fill = scull_ring_data_size(ring);
+    trace_scull_write(MINOR(dev->devno), retval, fill, ring->size);
+
+    mutex_unlock(lock);
+
+    scull_stat_inc(dev, write_ops);
+    scull_stat_add(dev, write_bytes, retval);
+    scull_stat_hist(dev, write_size, retval);
+    scull_stat_hist(dev, write_fill, fill);
+
+    // После записи в буфере точно появились новые данные
+    // Будим процессы, ждущие в очереди чтения, с учетом порога. Если все
+    // забрал читатель напрямую, в кольце ничего нового, а его разбудил
+    // scull_handoff_put
+    if (queued)
+        scull_wake_readers(dev);
+    return retval;
+
+// Метка выхода из функции при ошибке
+out:
+    mutex_unlock(lock);
+    return retval; 
+}
+
+static void scull_vma_open(struct vm_area_struct *vma)
+{
+    struct scull_ring_buffer *dev = vma->vm_private_data;
+
+    atomic_inc(&dev->mmap_count);
+}
+
+static void scull_vma_close(struct vm_area_struct *vma)
+{
+    struct scull_ring_buffer *dev = vma->vm_private_data;
+
+    atomic_dec(&dev->mmap_count);
+}
+
+// Считаем отображения, чтобы не менять размер буфера под ногами у mmap-клиентов
+static const struct vm_operations_struct scull_vm_ops = {
+    .open = scull_vma_open,
+    .close = scull_vma_close,
+};
+
+// Копии отображения при fork(2) и разрезании vma. Первое отображение
+// создает scull_mmap_telemetry - она же запускает обновление страницы
+static void scull_telemetry_vma_open(struct vm_area_struct *vma)
+{
+    struct scull_telemetry_page *tp = vma->vm_private_data;
+
+    atomic_inc(&tp->maps);
+}
+
+static void scull_telemetry_vma_close(struct vm_area_struct *vma)
+{
+    struct scull_telemetry_page *tp = vma->vm_private_data;
+
+    // Работа увидит ноль и больше себя не запустит
+    atomic_dec(&tp->maps);
+}
+
+static const struct vm_operations_struct scull_telemetry_vm_ops = {
+    .open = scull_telemetry_vma_open,
+    .close = scull_telemetry_vma_close,
+};
+
+// Последнее отображение снято - отпускаем страницу
+static int scull_telemetry_file_release(struct inode *inode, struct file *filp)
+{
+    scull_telemetry_put(filp->private_data);
+    return 0;
+}
+
+static const struct file_operations scull_telemetry_fops = {
+    .owner = THIS_MODULE,
+    .release = scull_telemetry_file_release,
+};
+
+// Страница телеметрии отображается только на чтение, в том числе без
+// права потом включить запись через mprotect.
+//
+// Отображение держало бы файл устройства, а с ним и ссылку на устройство:
+// пока монитор работает, SCULL_CTL_DESTROY отвечал бы -EBUSY. Поэтому файл
+// отображения подменяется anon-файлом, который держит только страницу.
+// Устройство можно удалить, страница остается у монитора с флагом
+// SCULL_TELEMETRY_REMOVED
+static int scull_mmap_telemetry(struct scull_ring_buffer *dev, struct vm_area_struct *vma)
+{
+    struct scull_telemetry_page *tp = dev->telemetry;
+    struct file *file;
+    int ret;
+
+    if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+        return -EINVAL;
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+
+    // Ссылку anon-файла отпустит scull_telemetry_file_release
+    kref_get(&tp->ref);
+    file = anon_inode_getfile("[scull_telemetry]", &scull_telemetry_fops, tp, O_RDONLY);
+    if (IS_ERR(file)) {
+        scull_telemetry_put(tp);
+        return PTR_ERR(file);
+    }
+
+    ret = vm_insert_page(vma, vma->vm_start, vmalloc_to_page(tp->page));
+    if (ret) {
+        fput(file);
+        return ret;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+    vma_set_file(vma, file);
+    fput(file);
+#else
+    // Ссылка на file переходит к vma, ссылку на файл устройства отпускаем
+    swap(vma->vm_file, file);
+    fput(file);
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_mod(vma, VM_DONTEXPAND | VM_DONTDUMP, VM_MAYWRITE);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    vma->vm_ops = &scull_telemetry_vm_ops;
+    vma->vm_private_data = tp;
+    // Первое отображение запускает обновление страницы
+    if (atomic_inc_return(&tp->maps) == 1)
+        mod_delayed_work(system_wq, &dev->telemetry_work, 0);
+    return 0;
+}
+
+// Отображение страницы управления и буфера в адресное пространство процесса.
+// Страница 0 - struct scull_ring_ctrl, со страницы 1 (ctrl->data_offset) - данные кольца.
+// По смещению SCULL_TELEMETRY_OFFSET - страница телеметрии
+static int scull_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct scull_ring_buffer *dev = filp->private_data;
+    unsigned long npages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+    unsigned long pgoff = vma->vm_pgoff;
+    unsigned long i;
+    void *kaddr;
+    int ret = 0;
+
+    if (pgoff == SCULL_TELEMETRY_OFFSET >> PAGE_SHIFT)
+        return scull_mmap_telemetry(dev, vma);
+
+    // Приватное отображение не имеет смысла: индексы должны быть общими
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    mutex_lock(&dev->map_lock);
+
+    // Под-кольца не описаны в странице управления, mmap-клиент их не поймет.
+    // В режиме перезаписи tail двигает и писатель - консюмер mmap это не учитывает
+    if (dev->mode & (SCULL_MODE_PERCPU | SCULL_MODE_OVERWRITE)) {
+        ret = -EBUSY;
+        goto out;
+    }
+
+    // Запрошенный диапазон не должен выходить за страницу управления и буфер
+    if (pgoff + npages < pgoff ||
+        pgoff + npages > 1 + (PAGE_ALIGN(dev->ring.size) >> PAGE_SHIFT)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    for (i = 0; i < npages; i++, pgoff++) {
+        kaddr = pgoff == 0 ? (void *)dev->ctrl : dev->ring.buffer + ((pgoff - 1) << PAGE_SHIFT);
+        ret = vm_insert_page(vma, vma->vm_start + (i << PAGE_SHIFT), vmalloc_to_page(kaddr));
+        if (ret)
+            goto out;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+    vma->vm_ops = &scull_vm_ops;
+    vma->vm_private_data = dev;
+    // Для первого отображения ядро не вызывает vm_ops->open
+    scull_vma_open(vma);
+
+out:
+    mutex_unlock(&dev->map_lock);
+    return ret;
+}
+
+// Изменение размера буфера на лету с сохранением данных. Данные переносятся
+// в начало нового буфера, поэтому при смене размера tail = 0, head = объем данных
+static int scull_resize(struct scull_ring_buffer *dev, unsigned long new_size)
+{
+    char *new_buffer;
+    u32 head, tail, used;
+    int retval = 0;
+
+    if (new_size == 0 || new_size > MAX_BUFFER_SIZE)
+        return -EINVAL;
+    new_size = scull_ring_size(new_size);
+
+    new_buffer = scull_buffer_alloc(dev->node, new_size);
+    if (!new_buffer)
+        return -ENOMEM;
+
+    // Останавливаем и писателей, и читателей
+    mutex_lock(&dev->write_lock);
+    mutex_lock(&dev->read_lock);
+    mutex_lock(&dev->map_lock);
+
+    // Отображенные страницы старого буфера остались бы у клиентов, а
+    // данные под-колец пришлось бы раскладывать заново
+    // Связанному устройству размер не меняем: перенос полагается на то, что
+    // запись источника помещается в приемник
+    if (atomic_read(&dev->mmap_count) || (dev->mode & SCULL_MODE_PERCPU) ||
+        dev->link || dev->link_src) {
+        retval = -EBUSY;
+        goto out;
+    }
+
+    head = scull_ring_load(&dev->ring, dev->ring.head);
+    tail = scull_ring_load(&dev->ring, dev->ring.tail);
+    used = scull_ring_used(&dev->ring, head, tail);
+    if (used > new_size) {
+        retval = -ENOSPC;
+        goto out;
+    }
+
+    scull_ring_copy_out(&dev->ring, tail, new_buffer, used);
+    write_seqlock(&dev->status_lock);
+    swap(dev->ring.buffer, new_buffer);
+    scull_set_ring(dev, dev->ring.buffer, new_size);
+    WRITE_ONCE(dev->ctrl->tail, 0);
+    smp_store_release(&dev->ctrl->head, used);
+    write_sequnlock(&dev->status_lock);
+
+out:
+    mutex_unlock(&dev->map_lock);
+    mutex_unlock(&dev->read_lock);
+    mutex_unlock(&dev->write_lock);
+
+    // Освобождаем старый буфер (или новый, если заменить не удалось)
+    vfree(new_buffer);
+
+    // Условия ожидания изменились для обеих сторон. Перепроверить размер
+    // должны все читатели, в том числе эксклюзивные
+    wake_up_interruptible_all(&dev->read_queue);
+    wake_up_interruptible_poll(&dev->write_queue, EPOLLOUT | EPOLLWRNORM);
+    smp_mb();
+    scull_notify_async(dev);
+    return retval;
+}
+
+// poll/select/epoll. Спящие в read/write и ожидающие в poll делят одни и те же
+// очереди; пробуждения передают маску событий, поэтому epoll будит только тех,
+// кого интересует именно это направление. Каждая операция будит очередь заново,
+// так что режим EPOLLET получает событие на каждое изменение заполненности
+static __poll_t scull_poll(struct file *filp, poll_table *wait)
+{
+    struct scull_ring_buffer *dev = filp->private_data;
 
-// Объявления функций файловых операций
-static int scull_open(struct inode *inode, struct file *filp);
-static int scull_release(struct inode *inode, struct file *filp);
-static ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
-static ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
-static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+    poll_wait(filp, &dev->read_queue, wait);
+    poll_wait(filp, &dev->write_queue, wait);
 
-// Структура файловых операций - связывает системные вызовы с нашими функциями
-static struct file_operations scull_fops = {
-    .owner = THIS_MODULE,    
-    .open = scull_open,      
-    .release = scull_release, 
-    .read = scull_read,      
-    .write = scull_write,    
-    .unlocked_ioctl = scull_ioctl
-};
+    return scull_poll_mask(dev);
+}
 
-// Функция открытия устройства
-static int scull_open(struct inode *inode, struct file *filp)
+// Функция инициализации модуля (вызывается при загрузке)
+// Файлы debugfs: /sys/kernel/debug/scull_ring_buffer/<minor>/{stats,histograms}.
+// Счетчики всех CPU складываются при чтении; между CPU срез не атомарный,
+// но каждый счетчик монотонен
+#define SCULL_STAT_SUM(dev, field) ({                            \
+    u64 __sum = 0;                                              \
+    int __cpu;                                                  \
+    for_each_possible_cpu(__cpu)                                \
+        __sum += per_cpu_ptr((dev)->stats, __cpu)->field;       \
+    __sum;                                                      \
+})
+
+static int scull_stats_show(struct seq_file *m, void *unused)
 {
-    struct scull_ring_buffer *dev; 
-    int minor = iminor(inode); 
+    struct scull_ring_buffer *dev = m->private;
+
+#define SHOW(field) seq_printf(m, "%-14s %llu\n", #field, SCULL_STAT_SUM(dev, field))
+    SHOW(read_bytes);
+    SHOW(read_ops);
+    SHOW(write_bytes);
+    SHOW(write_ops);
+    SHOW(read_sleeps);
+    SHOW(write_sleeps);
+    SHOW(read_eagain);
+    SHOW(write_eagain);
+    SHOW(read_wakeups);
+    SHOW(write_wakeups);
+    SHOW(read_retries);
+    SHOW(read_handoffs);
+    SHOW(direct_bytes);
+    SHOW(forward_bytes);
+#undef SHOW
+    seq_printf(m, "%-14s %lld\n", "dropped_bytes", (long long)atomic64_read(&dev->dropped));
+    seq_printf(m, "%-14s %u\n", "overruns", (u32)atomic_read(&dev->overruns));
+    seq_printf(m, "%-14s %u\n", "data_size", scull_data_size(dev));
+    seq_printf(m, "%-14s %u\n", "buffer_size", READ_ONCE(dev->ring.size));
+    seq_printf(m, "%-14s %d\n", "numa_node", dev->node);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_stats);
 
-    // Проверяем, что minor номер в допустимом диапазоне
-    if (minor >= num_devices) {
-        return -ENODEV; 
+// Гистограмма выводится только по непустым ячейкам: "[от, до) количество"
+static void scull_show_hist(struct seq_file *m, struct scull_ring_buffer *dev,
+                            const char *name, size_t offset)
+{
+    u64 sum;
+    int cpu, i;
+
+    seq_printf(m, "%s:\n", name);
+    for (i = 0; i < SCULL_HIST_BUCKETS; i++) {
+        sum = 0;
+        for_each_possible_cpu(cpu)
+            sum += ((u64 *)((char *)per_cpu_ptr(dev->stats, cpu) + offset))[i];
+        if (!sum)
+            continue;
+        if (i == 0)
+            seq_printf(m, "  [0, 1) %llu\n", sum);
+        else
+            seq_printf(m, "  [%llu, %llu) %llu\n", 1ULL << (i - 1), 1ULL << i, sum);
     }
+}
 
-    // Получаем указатель на структуру устройства по minor номеру
-    dev = &devices[minor];
-    filp->private_data = dev;
+static int scull_histograms_show(struct seq_file *m, void *unused)
+{
+    struct scull_ring_buffer *dev = m->private;
+
+#define SHOW(field) scull_show_hist(m, dev, #field, offsetof(struct scull_stats, field))
+    SHOW(read_wait_us);
+    SHOW(write_wait_us);
+    SHOW(read_size);
+    SHOW(write_size);
+    SHOW(write_fill);
+    SHOW(residency_us);
+#undef SHOW
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_histograms);
 
-    // Выводим информационное сообщение в журнал ядра
-    printk(KERN_ALERT "scull_ring_buffer: Device %d opened\n", minor);
-    return 0; // Успешное завершение
+// Каталог статистики устройства. Ошибки debugfs не проверяем: без него
+// драйвер работает так же
+static struct dentry *scull_debugfs_add(struct scull_ring_buffer *dev, int minor)
+{
+    struct dentry *dir;
+    char name[16];
+
+    snprintf(name, sizeof(name), "%d", minor);
+    dir = debugfs_create_dir(name, scull_debugfs);
+    debugfs_create_file("stats", 0444, dir, dev, &scull_stats_fops);
+    debugfs_create_file("histograms", 0444, dir, dev, &scull_histograms_fops);
+    return dir;
 }
 
-// Функция закрытия устройства
-static int scull_release(struct inode *inode, struct file *filp)
+// Состояние устройства для SCULL_IOC_STATUS и SCULL_CTL_STATUS_ALL. Мьютексы
+// не берем: режим, размер и позиции согласованы через status_lock, остальное
+// - атомарные загрузки и суммы счетчиков по CPU
+static void scull_fill_status(struct scull_ring_buffer *dev, struct scull_status *st)
 {
-    printk(KERN_ALERT "scull_ring_buffer: Device %d closed\n", iminor(inode));
-    return 0; // Успешное завершение
+    unsigned int seq;
+    u32 head, tail;
+
+    memset(st, 0, sizeof(*st));
+    st->version = SCULL_STATUS_VERSION;
+    st->minor = MINOR(dev->devno);
+    do {
+        seq = read_seqbegin(&dev->status_lock);
+        st->mode = READ_ONCE(dev->mode);
+        st->size = READ_ONCE(dev->ring.size);
+        st->capacity = scull_capacity(dev);
+        head = scull_ring_load(&dev->ring, dev->ring.head);
+        tail = scull_ring_load(&dev->ring, dev->ring.tail);
+        st->read_index = scull_ring_index(&dev->ring, tail);
+        st->write_index = scull_ring_index(&dev->ring, head);
+        st->data_size = (st->mode & SCULL_MODE_PERCPU) ? scull_data_size(dev)
+                                                       : scull_ring_used(&dev->ring, head, tail);
+    } while (read_seqretry(&dev->status_lock, seq));
+
+    st->read_waiters = READ_ONCE(dev->ctrl->read_waiters);
+    st->write_waiters = READ_ONCE(dev->ctrl->write_waiters);
+    st->read_bytes = SCULL_STAT_SUM(dev, read_bytes);
+    st->write_bytes = SCULL_STAT_SUM(dev, write_bytes);
+    st->read_ops = SCULL_STAT_SUM(dev, read_ops);
+    st->write_ops = SCULL_STAT_SUM(dev, write_ops);
+    st->forward_bytes = SCULL_STAT_SUM(dev, forward_bytes);
+    st->dropped_bytes = atomic64_read(&dev->dropped);
 }
 
-// Функция чтения из устройства
-static ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+// Копирование состояния в структуру пользователя размера usize: старая
+// программа получает свой префикс, новой недостающие поля обнуляются
+static int scull_copy_status(void __user *ubuf, size_t usize, const struct scull_status *st)
 {
-    struct scull_ring_buffer *dev = filp->private_data; // Получаем наше устройство
-    ssize_t retval = 0;                            // Возвращаемое значение (количество прочитанных байт)
-    int bytes_to_read;                             // Сколько байт будем читать в этой операции
-    int bytes_read_first_part;                     // Сколько байт прочитаем из первой части буфера
+    if (usize < offsetofend(struct scull_status, version))
+        return -EINVAL;
+    if (copy_to_user(ubuf, st, min(usize, sizeof(*st))))
+        return -EFAULT;
+    if (usize > sizeof(*st) && clear_user(ubuf + sizeof(*st), usize - sizeof(*st)))
+        return -EFAULT;
+    return 0;
+}
 
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS; 
+// Обновление страницы телеметрии. Работа одна на устройство и сама с собой
+// параллельно не выполняется, поэтому писатель страницы всегда один
+static void scull_telemetry_update(struct work_struct *work)
+{
+    struct scull_ring_buffer *dev = container_of(to_delayed_work(work),
+                                                 struct scull_ring_buffer, telemetry_work);
+    struct scull_telemetry *t = dev->telemetry->page;
+    struct scull_status st;
+
+    scull_fill_status(dev, &st);
+
+    // Протокол seqcount: нечетный seq - страница меняется
+    WRITE_ONCE(t->seq, t->seq + 1);
+    smp_wmb();
+    t->interval_ms = telemetry_ms;
+    t->update_ns = ktime_get_ns();
+    t->status = st;
+    smp_wmb();
+    WRITE_ONCE(t->seq, t->seq + 1);
+
+    if (atomic_read(&dev->telemetry->maps))
+        schedule_delayed_work(&dev->telemetry_work, msecs_to_jiffies(telemetry_ms));
+}
 
-    // Ждем, пока в буфере появятся данные для чтения
-    while (dev->data_size == 0) {
+// Снимок всех устройств за один вызов. Таблица устройств держится на время
+// снимка, поэтому набор устройств в нем согласован; мьютексы самих
+// устройств не берутся. Буфер - по длине массива пользователя, остальные
+// устройства только считаются
+static int scull_status_all(struct scull_status_all __user *ureq)
+{
+    struct scull_status_all req;
+    struct scull_status *st = NULL;
+    u32 n = 0, len, i;
+    int ret = 0;
+
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EFAULT;
+    if (req.size < offsetofend(struct scull_status, version))
+        return -EINVAL;
 
-        mutex_unlock(&dev->lock);
-        // Проверяем, открыто ли устройство в неблокирующем режиме
-        if (filp->f_flags & O_NONBLOCK)
-            return -EAGAIN; 
+    len = min_t(u32, req.count, MAX_DEVICES);
+    if (len) {
+        st = kvcalloc(len, sizeof(*st), GFP_KERNEL);
+        if (!st)
+            return -ENOMEM;
+    }
 
-        // Сообщаем, что процесс идет спать из-за пустого буфера
-        printk(KERN_ALERT "scull_ring_buffer: Buffer empty, process %d (%s) going to sleep\n",
-                current->pid, current->comm);
+    mutex_lock(&scull_devices_lock);
+    for (i = 0; i < MAX_DEVICES; i++) {
+        if (!devices[i])
+            continue;
+        if (n < len)
+            scull_fill_status(devices[i], &st[n]);
+        n++;
+    }
+    mutex_unlock(&scull_devices_lock);
 
-        // Усыпляем процесс в очереди чтения. Проснется когда data_size > 0
-        // wait_event_interruptible проверяет условие после пробуждения
-        if (wait_event_interruptible(dev->read_queue, (dev->data_size > 0)))
-            return -ERESTARTSYS;
+    // Массив пользователя мог оказаться мал - count вернет, сколько нужно
+    for (i = 0; i < min(n, len) && !ret; i++)
+        ret = scull_copy_status(u64_to_user_ptr(req.buf + (u64)i * req.size), req.size, &st[i]);
+    if (!ret && put_user(n, &ureq->count))
+        ret = -EFAULT;
 
-        // Проснулись, снова пытаемся захватить мьютекс
-        if (mutex_lock_interruptible(&dev->lock))
-            return -ERESTARTSYS;
-    }
+    kvfree(st);
+    return ret;
+}
 
-    // Определяем, сколько байт можем прочитать (минимум из запрошенного и доступного)
-    bytes_to_read = min(count, (size_t)dev->data_size);
+static bool scull_minor_free(int minor)
+{
+    return !devices[minor] && !test_bit(minor, scull_minors_reserved);
+}
 
-    // Первая часть чтения - до конца буфера
-    bytes_read_first_part = min(bytes_to_read, dev->size - dev->read_index);
+// Создание устройства с указанным minor (-1 - первый свободный), размером
+// буфера, режимом и NUMA-узлом. Возвращает minor или код ошибки.
+//
+// Под scull_devices_lock только выбирается minor: буфер до гигабайта и
+// под-кольца выделяются без мьютекса и не задерживают open(2), связи и
+// удаление других устройств. Устройство попадает в таблицу до device_create,
+// так что open(2), вызванный udev по событию о новом узле, его найдет
+static int scull_create_device(int minor, unsigned long size, u32 mode, int node)
+{
+    struct scull_ring_buffer *dev;
+    struct device *device;
+    int err;
 
-    if (copy_to_user(buf, dev->buffer + dev->read_index, bytes_read_first_part)) {
-        retval = -EFAULT; 
-        goto out; 
-    }
+    if (size == 0 || size > MAX_BUFFER_SIZE)
+        return -EINVAL;
+    if (node != NUMA_NO_NODE && (node < 0 || node >= nr_node_ids || !node_online(node)))
+        return -EINVAL;
 
-    // Вторая часть чтения
-    if (bytes_to_read > bytes_read_first_part) {
-        if (copy_to_user(buf + bytes_read_first_part, dev->buffer, 
-                        bytes_to_read - bytes_read_first_part)) {
-            retval = -EFAULT; // Ошибка копирования
-            goto out; // Переходим к метке выхода
+    mutex_lock(&scull_devices_lock);
+
+    if (minor < 0) {
+        for (minor = 0; minor < MAX_DEVICES && !scull_minor_free(minor); minor++)
+            ;
+        if (minor == MAX_DEVICES) {
+            err = -ENOSPC;
+            goto out;
         }
+    } else if (minor >= MAX_DEVICES) {
+        err = -EINVAL;
+        goto out;
+    } else if (!scull_minor_free(minor)) {
+        err = -EEXIST;
+        goto out;
+    }
+    set_bit(minor, scull_minors_reserved);
+    mutex_unlock(&scull_devices_lock);
+
+    dev = kzalloc_node(sizeof(*dev), GFP_KERNEL, node);
+    if (!dev) {
+        err = -ENOMEM;
+        goto fail_alloc;
     }
-    
-    dev->read_index = (dev->read_index + bytes_to_read) % dev->size;
-    dev->data_size -= bytes_to_read;
-    retval = bytes_to_read;
 
-    // Информационное сообщение о успешном чтении
-    printk(KERN_ALERT "scull_ring_buffer: Read %zu bytes from device %d. Data size: %d/%d\n",
-            retval, iminor(filp->f_path.dentry->d_inode), dev->data_size, dev->size);
+    // Выделяем память под кольцевой буфер и страницу управления.
+    // Память выделяется обнуленной, так что head = tail = 0
+    dev->node = node;
+    err = scull_alloc_ring(dev, scull_ring_size(size));
+    if (err) {
+        pr_err("scull_ring_buffer: Failed to allocate buffer for device %d\n", minor);
+        goto fail_ring;
+    }
 
-    // Будим все процессы, ждущие в очереди записи
-    wake_up_interruptible(&dev->write_queue);
+    // Инициализируем мьютекс для синхронизации
+    mutex_init(&dev->lock);
+    mutex_init(&dev->read_lock);
+    mutex_init(&dev->write_lock);
+    spin_lock_init(&dev->waiters_lock);
+    mutex_init(&dev->map_lock);
+    spin_lock_init(&dev->link_lock);
+    spin_lock_init(&dev->async_lock);
+    spin_lock_init(&dev->handoff_lock);
+    seqlock_init(&dev->status_lock);
+    atomic_set(&dev->mmap_count, 0);
+    atomic_set(&dev->overruns, 0);
+    atomic64_set(&dev->dropped, 0);
+    kref_init(&dev->ref);
+    // Инициализируем очереди ожидания для читателей и писателей
+    init_waitqueue_head(&dev->read_queue);
+    init_waitqueue_head(&dev->write_queue);
+    dev->read_wmark = 1;
+    dev->write_wmark = 1;
+    dev->wake_timeout = msecs_to_jiffies(DEFAULT_WAKE_TIMEOUT_MS);
+    INIT_DELAYED_WORK(&dev->read_flush, scull_read_flush);
+    INIT_WORK(&dev->forward, scull_forward);
+    INIT_DELAYED_WORK(&dev->telemetry_work, scull_telemetry_update);
+
+    // Режим проверяется и применяется так же, как SCULL_IOC_SET_MODE
+    err = scull_set_mode(dev, mode);
+    if (err)
+        goto fail_mode;
+
+    dev->devno = MKDEV(major_num, minor);
+
+    // Инициализируем структуру cdev и связываем с файловыми операциями
+    dev->cdev = cdev_alloc();
+    if (!dev->cdev) {
+        err = -ENOMEM;
+        goto fail_mode;
+    }
+    dev->cdev->ops = &scull_fops;
+    dev->cdev->owner = THIS_MODULE; // Устанавливаем владельца
+
+    // Добавляем символьное устройство в систему
+    err = cdev_add(dev->cdev, dev->devno, 1);
+    if (err) {
+        pr_err("scull_ring_buffer: Error %d adding device %d\n", err, minor);
+        kobject_put(&dev->cdev->kobj);
+        goto fail_mode;
+    }
 
-// Метка выхода из функции
+    // Публикуем устройство со второй ссылкой - ссылкой создателя: пока узел
+    // и debugfs не готовы, удаление получит -EBUSY
+    kref_get(&dev->ref);
+    mutex_lock(&scull_devices_lock);
+    devices[minor] = dev;
+    clear_bit(minor, scull_minors_reserved);
+    mutex_unlock(&scull_devices_lock);
+
+    // Создаем устройство в /dev через sysfs
+    device = device_create(scull_class, NULL, dev->devno, NULL, "scull_ring_buffer%d", minor);
+    if (IS_ERR(device)) {
+        err = PTR_ERR(device);
+        // Узла не было, но открыть устройство через свой mknod могли: память
+        // освободит последняя ссылка
+        mutex_lock(&scull_devices_lock);
+        devices[minor] = NULL;
+        mutex_unlock(&scull_devices_lock);
+        cdev_del(dev->cdev);
+        scull_dev_put(dev);
+        scull_dev_put(dev);
+        return err;
+    }
+    dev->debugfs = scull_debugfs_add(dev, minor);
+
+    // Сообщаем об успешном создании устройства
+    pr_info("scull_ring_buffer: Device /dev/scull_ring_buffer%d created (buffer size: %u bytes)\n",
+            minor, dev->ring.size);
+    // Дальше устройство могут удалить в любой момент
+    scull_dev_put(dev);
+    return minor;
+
+fail_mode:
+    scull_free_ring(dev);
+fail_ring:
+    kfree(dev);
+fail_alloc:
+    mutex_lock(&scull_devices_lock);
+    clear_bit(minor, scull_minors_reserved);
 out:
-    mutex_unlock(&dev->lock);
-    return retval; 
+    mutex_unlock(&scull_devices_lock);
+    return err;
 }
 
-// Функция записи в устройство
-static ssize_t scull_write(struct file *filp
-    , const char __user *buf
-    , size_t count
-    , loff_t *f_pos)
+// Устройство уже убрано из таблицы: новые open(2) его не найдут. Уже
+// открытые файлы держат свои ссылки, память освободит последняя из них
+static void scull_remove_device(struct scull_ring_buffer *dev)
 {
-    struct scull_ring_buffer *dev = filp->private_data; // Получаем наше устройство
-    ssize_t retval = 0;          
-    int space_available;         
-    int bytes_to_write;          
-    int bytes_write_first_part; 
-
-    // Захватываем мьютекс
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS; 
+    // debugfs дожидается уже открытых читателей статистики
+    debugfs_remove_recursive(dev->debugfs);
+    // Удаляем устройство из /dev
+    device_destroy(scull_class, dev->devno);
+    // Удаляем символьное устройство из системы
+    cdev_del(dev->cdev);
+    scull_dev_put(dev);
+}
 
-    // Вычисляем свободное место в буфере
-    space_available = dev->size - dev->data_size;
+// Удаление устройства через /dev/scull_ctl. Пока устройство открыто или
+// отображено, удалять его нельзя: -EBUSY. Отображения страницы телеметрии
+// не в счет - они держат только саму страницу (см. scull_mmap_telemetry)
+static int scull_destroy_device(unsigned long minor)
+{
+    struct scull_ring_buffer *dev;
+    int err = 0;
+
+    mutex_lock(&scull_devices_lock);
+    dev = minor < MAX_DEVICES ? devices[minor] : NULL;
+    if (!dev)
+        err = -ENODEV;
+    else if (kref_read(&dev->ref) > 1)
+        err = -EBUSY;
+    else
+        devices[minor] = NULL;
+    mutex_unlock(&scull_devices_lock);
+
+    if (err)
+        return err;
+    scull_remove_device(dev);
+    pr_info("scull_ring_buffer: Device /dev/scull_ring_buffer%lu removed\n", minor);
+    return 0;
+}
 
-    // Ждем, пока в буфере появится свободное место для записи
-    while (space_available == 0) {
-        mutex_unlock(&dev->lock);
+// Управляющее устройство /dev/scull_ctl: создание и удаление устройств без
+// перезагрузки модуля. Доступно только администратору, снимок состояния -
+// всем: узел открыт на чтение
+static long scull_ctl_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct scull_create req;
 
-        // Проверяем, открыто ли устройство в неблокирующем режиме
-        if (filp->f_flags & O_NONBLOCK)
-            return -EAGAIN; 
-        
-        pr_info("scull_ring_buffer: Buffer full, process %d (%s) going to sleep\n",
-                current->pid, current->comm);
+    // Снимок состояния доступен всем, кому доступен сам узел
+    if (cmd == SCULL_CTL_STATUS_ALL)
+        return scull_status_all((struct scull_status_all __user *)arg);
 
-        // Усыпляем процесс в очереди записи. Проснется когда появится место
-        // Вычисляем space_available снова после пробуждения
-        if (wait_event_interruptible(dev->write_queue, 
-            (space_available = (dev->size - dev->data_size)) > 0))
-            return -ERESTARTSYS; // Было прерывание
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
 
-        if (mutex_lock_interruptible(&dev->lock))
-            return -ERESTARTSYS;
+    switch (cmd) {
+    case SCULL_CTL_CREATE:
+        if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+            return -EFAULT;
+        return scull_create_device(req.minor, req.size ? req.size : buffer_size,
+                                   req.mode, req.node);
+    case SCULL_CTL_DESTROY:
+        return scull_destroy_device(arg);
     }
+    return -ENOTTY;
+}
 
-    // Определяем, сколько байт можем записать (минимум из запрошенного и доступного)
-    bytes_to_write = min(count, (size_t)space_available);
+static const struct file_operations scull_ctl_fops = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = scull_ctl_ioctl,
+};
 
-    bytes_write_first_part = min(bytes_to_write, dev->size - dev->write_index);
+static struct miscdevice scull_ctl = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "scull_ctl",
+    .fops = &scull_ctl_fops,
+    .mode = 0644,
+};
 
-    // Копируем данные из пользовательского пространства в ядро (первая часть)
-    if (copy_from_user(dev->buffer + dev->write_index, buf, bytes_write_first_part)) {
-        retval = -EFAULT;
-        goto out;
+// Проверка параметров модуля
+static int scull_check_params(void)
+{
+    if (num_devices < 0 || num_devices > MAX_DEVICES) {
+        pr_err("scull_ring_buffer: Invalid number of devices: %d\n", num_devices);
+        return -EINVAL;
+    }
+    
+    if (buffer_size <= 0 || buffer_size > MAX_BUFFER_SIZE) {
+        pr_err("scull_ring_buffer: Invalid buffer size: %d\n", buffer_size);
+        return -EINVAL;
     }
 
-    // Копируем данные из пользовательского пространства в ядро (вторая часть, если есть)
-    if (bytes_to_write > bytes_write_first_part) {
-        if (copy_from_user(dev->buffer, buf + bytes_write_first_part, 
-                          bytes_to_write - bytes_write_first_part)) {
-            retval = -EFAULT; 
-            goto out; 
-        }
+    if (telemetry_ms <= 0 || telemetry_ms > MAX_TELEMETRY_MS) {
+        pr_err("scull_ring_buffer: Invalid telemetry period: %d ms\n", telemetry_ms);
+        return -EINVAL;
     }
+    return 0;
+}
 
-    // Обновляем индекс записи с учетом кольцевой структуры
-    dev->write_index = (dev->write_index + bytes_to_write) % dev->size;
-    dev->data_size += bytes_to_write;
-    retval = bytes_to_write;
+// Удаляем count устройств, начиная с minor first, в обратном порядке
+static void scull_remove_devices(int first, int count)
+{
+    while (--count >= 0) {
+        scull_remove_device(devices[first + count]);
+        devices[first + count] = NULL;
+    }
+}
 
-    // Информационное сообщение о успешной записи
-    pr_info("scull_ring_buffer: Wrote %zu bytes to device %d. Data size: %d/%d\n",
-            retval, iminor(filp->f_path.dentry->d_inode), dev->data_size, dev->size);
+// Устройства, заданные параметрами модуля: count штук подряд с minor first.
+// Если одно не создалось, удаляем уже созданные - все или ничего
+static int scull_create_devices(int first, int count, unsigned long size, u32 mode)
+{
+    int i, err;
 
-    // После записи в буфере точно появились новые данные
-    // Будим все процессы, ждущие в очереди чтения
-    wake_up_interruptible(&dev->read_queue);
+    for (i = 0; i < count; i++) {
+        int node = i < numa_node_count ? numa_node[i] : NUMA_NO_NODE;
 
-// Метка выхода из функции
-out:
-    mutex_unlock(&dev->lock);
-    return retval; 
+        err = scull_create_device(first + i, size, mode, node);
+        if (err < 0) {
+            pr_err("scull_ring_buffer: Failed to create device %d\n", first + i);
+            scull_remove_devices(first, i);
+            return err;
+        }
+    }
+    return 0;
 }
 
-// Функция инициализации модуля (вызывается при загрузке)
 static int __init scull_init(void)
 {
-    int i, err;           // Счетчик и переменная для ошибок
+    int err;              // Переменная для ошибок
     dev_t dev_num = 0;    // Номер устройства
 
     // Проверка параметров
-    if (num_devices <= 0) {
-        pr_err("scull_ring_buffer: Invalid number of devices: %d\n", num_devices);
-        return -EINVAL;
-    }
-    
-    if (buffer_size <= 0) {
-        pr_err("scull_ring_buffer: Invalid buffer size: %d\n", buffer_size);
-        return -EINVAL;
-    }
+    err = scull_check_params();
+    if (err)
+        return err;
 
     pr_info("scull_ring_buffer: Initializing with %d devices, buffer size: %d bytes\n", 
             num_devices, buffer_size);
 
-    // Запрашиваем динамическое выделение диапазона номеров устройств
-    // dev_num будет содержать первый номер, num_devices - количество устройств
-    err = alloc_chrdev_region(&dev_num, 0, num_devices, DEVICE_NAME);
+    // Запрашиваем динамическое выделение диапазона номеров устройств.
+    // Резервируем все MAX_DEVICES: устройства можно добавлять и после загрузки
+    err = alloc_chrdev_region(&dev_num, 0, MAX_DEVICES, DEVICE_NAME);
     if (err < 0) {
         pr_err("scull_ring_buffer: Failed to allocate device numbers\n");
         return err; 
@@ -272,14 +2582,6 @@ static int __init scull_init(void)
     // Сохраняем старший номер из выделенного диапазона
     major_num = MAJOR(dev_num);
 
-    // Выделяем память под массив устройств
-    devices = kmalloc_array(num_devices, sizeof(struct scull_ring_buffer), GFP_KERNEL);
-    if (!devices) {
-        pr_err("scull_ring_buffer: Failed to allocate devices array\n");
-        err = -ENOMEM;
-        goto fail_alloc;
-    }
-
     // Создаем класс устройств для автоматического создания узлов в /dev
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
     scull_class = class_create(DEVICE_NAME);
@@ -293,80 +2595,36 @@ static int __init scull_init(void)
         goto fail_class;
     }
 
-    // Инициализируем каждое устройство в цикле
-    for (i = 0; i < num_devices; i++) {
-        struct scull_ring_buffer *dev = &devices[i]; 
-
-        // Выделяем память под кольцевой буфер в пространстве ядра
-        dev->buffer = kmalloc(buffer_size, GFP_KERNEL);
-        if (!dev->buffer) {
-            pr_err("scull_ring_buffer: Failed to allocate buffer for device %d\n", i);
-            err = -ENOMEM; 
-            goto fail_device; 
-        }
-
-        // Инициализируем мьютекс для синхронизации
-        mutex_init(&dev->lock);
-        // Инициализируем очереди ожидания для читателей и писателей
-        init_waitqueue_head(&dev->read_queue);
-        init_waitqueue_head(&dev->write_queue);
-
-        // Инициализируем переменные буфера
-        dev->read_index = 0;  
-        dev->write_index = 0;  
-        dev->data_size = 0;   
-        dev->size = buffer_size;
-
-        dev->devno = MKDEV(major_num, i);
+    scull_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
 
-        // Инициализируем структуру cdev и связываем с файловыми операциями
-        cdev_init(&dev->cdev, &scull_fops);
-        dev->cdev.owner = THIS_MODULE; // Устанавливаем владельца
+    // Создаем устройства, заданные параметрами
+    err = scull_create_devices(0, num_devices, buffer_size, record_mode ? SCULL_MODE_RECORD : 0);
+    if (err)
+        goto fail_device;
 
-        // Добавляем символьное устройство в систему
-        err = cdev_add(&dev->cdev, dev->devno, 1);
-        if (err) {
-            pr_err("scull_ring_buffer: Error %d adding device %d\n", err, i);
-            kfree(dev->buffer); 
-            goto fail_device;
-        }
-
-        // Создаем устройство в /dev через sysfs
-        device_create(scull_class, NULL, dev->devno, NULL, "scull_ring_buffer%d", i);
-
-        // Сообщаем об успешном создании устройства
-        pr_info("scull_ring_buffer: Device /dev/scull_ring_buffer%d created (buffer size: %d bytes)\n", 
-                i, buffer_size);
+    err = misc_register(&scull_ctl);
+    if (err) {
+        pr_err("scull_ring_buffer: Failed to register /dev/scull_ctl\n");
+        goto fail_ctl;
     }
 
     pr_info("scull_ring_buffer: Module loaded successfully (major number = %d, devices = %d, buffer size = %d)\n", 
             major_num, num_devices, buffer_size);
     return 0;
 
-// Метка обработки ошибок при создании устройств
-fail_device:
+// Метки обработки ошибок при создании устройств
+fail_ctl:
     // Откат: удаляем все созданные устройства в обратном порядке
-    while (--i >= 0) {
-        // Удаляем устройство из /dev
-        device_destroy(scull_class, devices[i].devno);
-        // Удаляем символьное устройство из системы
-        cdev_del(&devices[i].cdev);
-        // Освобождаем память буфера
-        kfree(devices[i].buffer);
-    }
+    scull_remove_devices(0, num_devices);
+fail_device:
+    debugfs_remove_recursive(scull_debugfs);
     // Удаляем класс устройств
     class_destroy(scull_class);
 
 // Метка обработки ошибок при создании класса
 fail_class:
-    // Освобождаем массив устройств
-    kfree(devices);
-    devices = NULL;
-
-// Метка обработки ошибок при выделении памяти
-fail_alloc:
     // Освобождаем выделенные номера устройств
-    unregister_chrdev_region(dev_num, num_devices);
+    unregister_chrdev_region(dev_num, MAX_DEVICES);
     return err; // Возвращаем код ошибки
 }
 
@@ -375,44 +2633,293 @@ static void __exit scull_exit(void)
 {
     int i; 
 
-    // Удаляем все устройства в цикле
-    for (i = 0; i < num_devices; i++) {
-        // Удаляем устройство из /dev
-        device_destroy(scull_class, devices[i].devno);
-        // Удаляем символьное устройство из системы
-        cdev_del(&devices[i].cdev);
-        // Освобождаем память буфера
-        kfree(devices[i].buffer);
+    // Новых устройств больше не будет
+    misc_deregister(&scull_ctl);
+
+    // Удаляем все устройства: и созданные при загрузке, и через scull_ctl.
+    // Открытых файлов нет - они держат модуль
+    for (i = 0; i < MAX_DEVICES; i++) {
+        if (!devices[i])
+            continue;
+        scull_remove_device(devices[i]);
+        devices[i] = NULL;
     }
 
+    debugfs_remove_recursive(scull_debugfs);
     // Удаляем класс устройств
     class_destroy(scull_class);
-    // Освобождаем массив устройств
-    kfree(devices);
-    devices = NULL;
     // Освобождаем номера устройств
-    unregister_chrdev_region(MKDEV(major_num, 0), num_devices);
+    unregister_chrdev_region(MKDEV(major_num, 0), MAX_DEVICES);
 
     // Сообщение о успешной выгрузке модуля
     pr_info("scull_ring_buffer: Module unloaded\n");
 }
 
+// Смена режима. Формат данных в кольце зависит от режима, поэтому менять его
+// можно только на пустом буфере и только когда никто не читает и не пишет.
+// Писатели режима под-колец держат только мьютекс своего CPU, поэтому
+// захватываем их все (под write_lock, чтобы lockdep знал порядок)
+static int scull_set_mode(struct scull_ring_buffer *dev, unsigned long mode)
+{
+    int retval = 0;
+    int cpu;
+
+    if (mode & ~(unsigned long)SCULL_MODE_ALL)
+        return -EINVAL;
+    // Под-кольца пишутся без общего write_lock, выбрасывать из них нельзя
+    if ((mode & SCULL_MODE_PERCPU) && (mode & SCULL_MODE_OVERWRITE))
+        return -EINVAL;
+    // Время кладется в запись, потоку его положить некуда
+    if ((mode & SCULL_MODE_TIMESTAMP) && !(mode & SCULL_MODE_RECORD))
+        return -EINVAL;
+    // Читатель под-колец и перезаписи забирает данные не по одной записи
+    if ((mode & SCULL_MODE_WORKQUEUE) && (mode & (SCULL_MODE_PERCPU | SCULL_MODE_OVERWRITE)))
+        return -EINVAL;
+
+    mutex_lock(&dev->write_lock);
+    for_each_possible_cpu(cpu)
+        mutex_lock_nest_lock(&per_cpu_ptr(dev->subrings, cpu)->lock, &dev->write_lock);
+    mutex_lock(&dev->read_lock);
+    mutex_lock(&dev->map_lock);
+
+    // Формат данных связанных устройств должен совпадать - сначала разрываем связь
+    if (scull_data_size(dev) != 0 || dev->link || dev->link_src) {
+        retval = -EBUSY;
+        goto out;
+    }
+
+    if ((mode & SCULL_MODE_PERCPU) && !(dev->mode & SCULL_MODE_PERCPU)) {
+        // Под-кольца - срезы буфера, отображение через mmap их не описывает
+        if (atomic_read(&dev->mmap_count)) {
+            retval = -EBUSY;
+            goto out;
+        }
+        retval = scull_carve_subrings(dev);
+        if (retval)
+            goto out;
+    }
+    if ((mode & SCULL_MODE_OVERWRITE) && atomic_read(&dev->mmap_count)) {
+        retval = -EBUSY;
+        goto out;
+    }
+
+    write_seqlock(&dev->status_lock);
+    WRITE_ONCE(dev->mode, mode);
+    WRITE_ONCE(dev->ctrl->mode, mode);
+    write_sequnlock(&dev->status_lock);
+
+out:
+    mutex_unlock(&dev->map_lock);
+    mutex_unlock(&dev->read_lock);
+    for_each_possible_cpu(cpu)
+        mutex_unlock(&per_cpu_ptr(dev->subrings, cpu)->lock);
+    mutex_unlock(&dev->write_lock);
+
+    // Спящим писателям нужно перепроверить условия для нового режима, а
+    // читателям из эксклюзивной очереди - вернуться к обычному ожиданию
+    wake_up_interruptible_poll(&dev->write_queue, EPOLLOUT | EPOLLWRNORM);
+    if (!retval && !(mode & SCULL_MODE_WORKQUEUE))
+        wake_up_interruptible_all(&dev->read_queue);
+    return retval;
+}
+
+// Пороги пробуждения. Новые значения сразу применяем к спящим: после
+// снижения порога их условие может оказаться уже выполненным
+static int scull_set_wmark(struct scull_ring_buffer *dev, const struct scull_wmark *wm)
+{
+    if (wm->timeout_ms > MAX_WAKE_TIMEOUT_MS)
+        return -EINVAL;
+
+    WRITE_ONCE(dev->read_wmark, clamp_t(u32, wm->read_low, 1, MAX_BUFFER_SIZE));
+    WRITE_ONCE(dev->write_wmark, clamp_t(u32, wm->write_high, 1, MAX_BUFFER_SIZE));
+    WRITE_ONCE(dev->wake_timeout, msecs_to_jiffies(wm->timeout_ms));
+
+    wake_up_interruptible_poll(&dev->read_queue, EPOLLIN | EPOLLRDNORM);
+    wake_up_interruptible_poll(&dev->write_queue, EPOLLOUT | EPOLLWRNORM);
+    return 0;
+}
+
+// Копирование из кольца в память пользователя в две части с учетом заворота
+static int scull_ring_to_user(const struct scull_ring *ring, u32 pos, u32 len, void __user *dst)
+{
+    u32 first_part = scull_ring_first(ring, pos, len);
+
+    if (copy_to_user(dst, ring->buffer + scull_ring_index(ring, pos), first_part) ||
+        copy_to_user(dst + first_part, ring->buffer, len - first_part))
+        return -EFAULT;
+    return 0;
+}
+
+// Чтение без извлечения (SCULL_IOC_PEEK): данные остаются в кольце, пока
+// консюмер не подтвердит их SCULL_IOC_COMMIT. Повторный просмотр после сбоя
+// обработки отдаст те же байты - копию у себя консюмеру держать не нужно
+static long scull_peek(struct scull_ring_buffer *dev, struct file *filp,
+                       void __user *argp)
+{
+    struct scull_peek req;
+    u32 tail, data_size, need;
+    long retval;
+    bool record;
+
+    if (copy_from_user(&req, argp, sizeof(req)))
+        return -EFAULT;
+    if (req.len == 0)
+        return 0;
+
+    for (;;) {
+        if (mutex_lock_interruptible(&dev->read_lock))
+            return -ERESTARTSYS;
+
+        // Под-кольца не образуют одной последовательности, смещение в ней не
+        // определено; в режиме перезаписи просмотренное может пропасть до COMMIT
+        if (dev->mode & (SCULL_MODE_PERCPU | SCULL_MODE_OVERWRITE)) {
+            retval = -EOPNOTSUPP;
+            goto out;
+        }
+
+        record = dev->mode & SCULL_MODE_RECORD;
+        data_size = scull_ring_data_size(&dev->ring);
+        tail = scull_ring_load(&dev->ring, dev->ring.tail);
+        if (req.offset > data_size) {
+            retval = -EINVAL;
+            goto out;
+        }
+        // В режиме записей offset - сумма просмотренных записей, т.е. начало
+        // записи. Байт посреди записи разбирался бы как заголовок
+        if (record && req.offset) {
+            retval = scull_record_span(&dev->ring, tail, data_size, req.offset, &need);
+            if (retval >= 0 && retval != req.offset)
+                retval = -EINVAL;
+            if (retval < 0)
+                goto out;
+        }
+
+        if (record) {
+            retval = scull_record_span(&dev->ring, scull_ring_advance(&dev->ring, tail, req.offset),
+                                       data_size - req.offset, req.len, &need);
+        } else {
+            retval = min_t(u32, req.len, data_size - req.offset);
+            need = 1;
+        }
+        if (retval != 0)
+            break;
+
+        // Кольцо не вместит недостающее, пока просмотренное не подтверждено
+        if (req.offset + need > dev->ring.size) {
+            retval = -ENOBUFS;
+            goto out;
+        }
+
+        mutex_unlock(&dev->read_lock);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (scull_wait_data(dev, req.offset + need, false, NULL))
+            return -ERESTARTSYS;
+    }
+
+    if (retval > 0 &&
+        scull_ring_to_user(&dev->ring, scull_ring_advance(&dev->ring, tail, req.offset),
+                           retval, u64_to_user_ptr(req.buf)))
+        retval = -EFAULT;
+
+out:
+    mutex_unlock(&dev->read_lock);
+    return retval;
+}
+
+// Подтверждение просмотренного (SCULL_IOC_COMMIT): сдвигаем tail на len байт
+static long scull_commit(struct scull_ring_buffer *dev, unsigned long len)
+{
+    u32 tail, data_size, need;
+    long retval = 0;
+
+    if (len == 0)
+        return 0;
+
+    if (mutex_lock_interruptible(&dev->read_lock))
+        return -ERESTARTSYS;
+
+    if (dev->mode & (SCULL_MODE_PERCPU | SCULL_MODE_OVERWRITE)) {
+        retval = -EOPNOTSUPP;
+        goto out;
+    }
+
+    data_size = scull_ring_data_size(&dev->ring);
+    tail = scull_ring_load(&dev->ring, dev->ring.tail);
+    if (len > data_size) {
+        retval = -EINVAL;
+        goto out;
+    }
+    // Запись подтверждается только целиком
+    if ((dev->mode & SCULL_MODE_RECORD) &&
+        scull_record_span(&dev->ring, tail, data_size, len, &need) != len) {
+        retval = -EINVAL;
+        goto out;
+    }
+
+    scull_ring_commit_tail(&dev->ring, tail, len);
+
+out:
+    mutex_unlock(&dev->read_lock);
+    if (retval)
+        return retval;
+
+    scull_stat_inc(dev, read_ops);
+    scull_stat_add(dev, read_bytes, len);
+    scull_wake_writers(dev);
+    return 0;
+}
+
 // Добавим ioctl для Process C, чтобы получать состояние буфера
-static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+static long scull_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     struct scull_ring_buffer *dev = filp->private_data; // Получаем наше устройство
     int retval = 0;
+    u32 want;
 
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+    // Состояние: номер команды включает размер структуры пользователя,
+    // поэтому программы, собранные со старой struct scull_status, работают
+    // и после ее расширения
+    if (_IOC_TYPE(cmd) == SCULL_IOC_MAGIC && _IOC_NR(cmd) == _IOC_NR(SCULL_IOC_STATUS) &&
+        _IOC_DIR(cmd) == _IOC_READ) {
+        struct scull_status st;
+
+        scull_fill_status(dev, &st);
+        return scull_copy_status((void __user *)arg, _IOC_SIZE(cmd), &st);
+    }
 
+    // Команды mmap-клиентов: только сон и пробуждение, мьютекс не нужен
     switch (cmd) {
-    case 0: // Команда для получения размера данных в буфере
-        if (copy_to_user((int __user *)arg, &dev->data_size, sizeof(dev->data_size))) {
-            retval = -EFAULT;
-        }
-        break;
-    case 1: // Команда для получения полной информации о буфере
+    case SCULL_IOC_WAIT_DATA:
+        want = clamp_t(unsigned long, arg, 1, dev->ring.size);
+        if (scull_data_size(dev) >= want)
+            return 0;
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        return scull_wait_data(dev, want, false, NULL);
+    case SCULL_IOC_WAIT_SPACE:
+        want = clamp_t(unsigned long, arg, 1, dev->ring.size);
+        if (scull_space(dev) >= want)
+            return 0;
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        return scull_wait_space(dev, want);
+    case SCULL_IOC_NOTIFY:
+        scull_link_kick(dev);
+        smp_mb();
+        scull_notify_async(dev);
+        wake_up_interruptible_poll(&dev->read_queue, EPOLLIN | EPOLLRDNORM);
+        wake_up_interruptible_poll(&dev->write_queue, EPOLLOUT | EPOLLWRNORM);
+        return 0;
+    // Команды консюмера: упорядочены read_lock, как read(2)
+    case SCULL_IOC_PEEK:
+        return scull_peek(dev, filp, (void __user *)arg);
+    case SCULL_IOC_COMMIT:
+        return scull_commit(dev, arg);
+    // Устаревшие команды 0 и 1 (размер данных и struct buffer_info из int)
+    // оставлены для старых программ - новым нужен SCULL_IOC_STATUS
+    case 0:
+    case 1:
         {
             struct buffer_info {
                 int data_size;
@@ -420,18 +2927,76 @@ static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
                 int read_index;
                 int write_index;
             } info;
-            
-            info.data_size = dev->data_size;
-            info.buffer_size = dev->size;
-            info.read_index = dev->read_index;
-            info.write_index = dev->write_index;
-            
-            if (copy_to_user((void __user *)arg, &info, sizeof(info))) {
+            struct scull_status st;
+
+            scull_fill_status(dev, &st);
+            info.data_size = st.data_size;
+            info.buffer_size = st.size;
+            info.read_index = st.read_index;
+            info.write_index = st.write_index;
+            if (copy_to_user((void __user *)arg, &info, cmd == 0 ? sizeof(int) : sizeof(info)))
+                return -EFAULT;
+            return 0;
+        }
+    case SCULL_IOC_GET_DROPPED:
+        {
+            __u64 dropped = atomic64_read(&dev->dropped);
+
+            return copy_to_user((void __user *)arg, &dropped, sizeof(dropped)) ? -EFAULT : 0;
+        }
+    }
+
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+
+    switch (cmd) {
+    case SCULL_IOC_SET_MODE:
+        retval = scull_set_mode(dev, arg);
+        break;
+    case SCULL_IOC_GET_MODE:
+        retval = dev->mode;
+        break;
+    case SCULL_IOC_RESIZE:
+        retval = scull_resize(dev, arg);
+        break;
+    case SCULL_IOC_SET_WMARK:
+        {
+            struct scull_wmark wm;
+
+            if (copy_from_user(&wm, (void __user *)arg, sizeof(wm))) {
+                retval = -EFAULT;
+                break;
+            }
+            retval = scull_set_wmark(dev, &wm);
+        }
+        break;
+    case SCULL_IOC_LINK:
+        retval = scull_link(dev, (long)arg);
+        break;
+    case SCULL_IOC_SET_EVENTFD:
+        {
+            struct scull_eventfd req;
+
+            if (copy_from_user(&req, (void __user *)arg, sizeof(req))) {
+                retval = -EFAULT;
+                break;
+            }
+            retval = scull_set_eventfd(dev, filp, &req);
+        }
+        break;
+    case SCULL_IOC_GET_WMARK:
+        {
+            struct scull_wmark wm = {
+                .read_low = dev->read_wmark,
+                .write_high = dev->write_wmark,
+                .timeout_ms = jiffies_to_msecs(dev->wake_timeout),
+            };
+
+            if (copy_to_user((void __user *)arg, &wm, sizeof(wm))) {
                 retval = -EFAULT;
             }
         }
         break;
-    // Можно добавить другие команды, например, для чтения всего содержимого без извлечения
     default:
         retval = -ENOTTY;
     }
@@ -440,6 +3005,15 @@ static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     return retval;
 }
 
+static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct scull_ring_buffer *dev = filp->private_data;
+    long ret = scull_do_ioctl(filp, cmd, arg);
+
+    trace_scull_ioctl(MINOR(dev->devno), cmd, ret);
+    return ret;
+}
+
 // Указываем функции инициализации и очистки
 module_init(scull_init); // Функция scull_init будет вызвана при загрузке модуля
 module_exit(scull_exit); // Функция scull_exit будет вызвана при выгрузке модуля
@@ -447,4 +3021,10 @@ module_exit(scull_exit); // Функция scull_exit будет вызвана
 // Информация о модуле
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Mikhail Kalinin");
-MODULE_DESCRIPTION("Scull Driver with Ring Buffer and Locking"); 
\ No newline at end of file
+MODULE_DESCRIPTION("Scull Driver with Ring Buffer and Locking"); 
+
+// KUnit-тесты используют static-функции драйвера, поэтому собираются в той же
+// единице трансляции: make SCULL_KUNIT=1
+#ifdef SCULL_KUNIT_TEST
+#include "scull_ring_buffer_test.c"
+#endif
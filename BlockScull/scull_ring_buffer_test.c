@@ -0,0 +1,1217 @@
+// KUnit-тесты драйвера: ядро кольца (заворот, записи, перенос), read(2) и
+// write(2) устройства (блокировка, O_NONBLOCK, прерывание сигналом, режим
+// SCULL_MODE_WORKQUEUE, прямая передача), SCULL_IOC_PEEK, откат при ошибках
+// загрузки, многопоточный стресс и замеры пропускной способности.
+//
+// Файл не собирается отдельно: его включает scull_ring_buffer.c, чтобы
+// тестам были доступны static-функции драйвера. Сборка и запуск:
+//
+//   make KDIR=<дерево ядра> SCULL_KUNIT=1
+//   insmod scull_ring_buffer.ko num_devices=0
+//
+// Результаты - в dmesg и /sys/kernel/debug/kunit/<набор>/results. Ядро
+// собирается с фрагментом scull_kunit.config: под UML (ARCH=um) - с lockdep,
+// под QEMU (x86_64, arm64) к нему добавляется CONFIG_KCSAN=y. Стресс и замеры
+// помечены как медленные: kunit.filter="speed>slow" их пропускает.
+//
+// Вместо открытого через VFS файла тесты передают в read_iter/write_iter
+// struct file, в которой заполнены только private_data и f_flags, - больше
+// драйвер из нее ничего не берет. Блокирующие вызовы делают kthread, которым
+// разрешен SIGUSR1: так проверяется и -ERESTARTSYS.
+
+#include <kunit/test.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/delay.h>
+#include <linux/sched/signal.h>
+#include <linux/sched/task.h>
+#include <linux/mman.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
+#error "KUnit-тесты в модуле со своим module_init требуют ядра 6.0 и новее"
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
+#define KUNIT_CASE_PARAM_SLOW(test_name, gen) KUNIT_CASE_PARAM(test_name, gen)
+#else
+#define KUNIT_CASE_PARAM_SLOW(test_name, gen) \
+    KUNIT_CASE_PARAM_ATTR(test_name, gen, { .speed = KUNIT_SPEED_SLOW })
+#endif
+
+// Размер устройства для функциональных тестов и для стресса: в последнем
+// под-кольца режима SCULL_MODE_PERCPU не должны выйти меньше MIN_SUBRING_SIZE
+#define SCULL_TEST_SIZE 4096
+#define SCULL_STRESS_SIZE (64 * 1024)
+// Сколько ждать события, которое должно случиться сразу
+#define SCULL_TEST_TIMEOUT (5 * HZ)
+// Сколько ждать окончания стресса (под KCSAN он медленнее в десятки раз)
+#define SCULL_STRESS_TIMEOUT (120 * HZ)
+#define SCULL_STRESS_MAX_THREADS 8
+
+/* Ядро кольца: без устройства */
+
+// Байт потока со смещением n, как в scull_ring_stress
+static inline u8 scull_test_byte(u64 n)
+{
+    return (u8)(n ^ (n >> 8) ^ (n >> 16) ^ (n >> 24));
+}
+
+static void scull_test_fill(char *buf, size_t len, u64 from)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = scull_test_byte(from + i);
+}
+
+// Поток любой длины с любой стартовой позиции, включая вторую половину
+// диапазона [size, 2 * size), в кольцах со степенью двойки и без
+static void scull_ring_test_wrap_stream(struct kunit *test)
+{
+    static const u32 sizes[] = { 7, 8 };
+    struct scull_ring ring;
+    __u32 head, tail;
+    char in[8], out[8];
+    u32 i, start, len, need;
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        u32 size = sizes[i];
+        char *buffer = kunit_kzalloc(test, size, GFP_KERNEL);
+
+        KUNIT_ASSERT_NOT_NULL(test, buffer);
+        scull_ring_init(&ring, buffer, size, &head, &tail);
+        KUNIT_EXPECT_EQ(test, ring.mask, is_power_of_2(size) ? size - 1 : 0);
+
+        for (start = 0; start < 2 * size; start++) {
+            for (len = 1; len <= size; len++) {
+                head = tail = start;
+                scull_test_fill(in, len, start * 31 + len);
+
+                KUNIT_ASSERT_EQ(test, scull_ring_write(&ring, in, len, false), (ssize_t)len);
+                KUNIT_EXPECT_EQ(test, scull_ring_data_size(&ring), len);
+                KUNIT_EXPECT_LT(test, head, 2 * size);
+                if (len == size)
+                    KUNIT_EXPECT_EQ(test, scull_ring_write(&ring, in, 1, false), (ssize_t)-EAGAIN);
+
+                KUNIT_ASSERT_EQ(test, scull_ring_read(&ring, out, size, false, &need), (ssize_t)len);
+                KUNIT_EXPECT_EQ(test, memcmp(in, out, len), 0);
+                KUNIT_EXPECT_EQ(test, head, tail);
+                KUNIT_EXPECT_EQ(test, scull_ring_read(&ring, out, size, false, &need), (ssize_t)0);
+            }
+        }
+    }
+}
+
+// Запись с заголовком, разрезанным концом буфера, и с данными по обе стороны
+// от него; полный буфер и запись, которая не поместится никогда
+static void scull_ring_test_wrap_records(struct kunit *test)
+{
+    static const u32 sizes[] = { 17, 16 };
+    const u32 hdr = sizeof(struct scull_record_hdr);
+    struct scull_record_hdr rec;
+    struct scull_ring ring;
+    __u32 head, tail;
+    char in[16], out[17];
+    u32 i, start, len, need;
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        u32 size = sizes[i];
+        char *buffer = kunit_kzalloc(test, size, GFP_KERNEL);
+
+        KUNIT_ASSERT_NOT_NULL(test, buffer);
+        scull_ring_init(&ring, buffer, size, &head, &tail);
+
+        for (start = 0; start < 2 * size; start++) {
+            for (len = 0; len <= size - hdr; len++) {
+                head = tail = start;
+                scull_test_fill(in, len, start + len);
+
+                KUNIT_ASSERT_EQ(test, scull_ring_write(&ring, in, len, true), (ssize_t)len);
+                KUNIT_EXPECT_EQ(test, scull_ring_data_size(&ring), hdr + len);
+                if (len == size - hdr)
+                    KUNIT_EXPECT_EQ(test, scull_ring_write(&ring, in, 0, true), (ssize_t)-EAGAIN);
+
+                // Буфер на байт меньше записи: запись не режется
+                KUNIT_EXPECT_EQ(test, scull_ring_read(&ring, out, hdr + len - 1, true, &need),
+                                (ssize_t)-EMSGSIZE);
+
+                KUNIT_ASSERT_EQ(test, scull_ring_read(&ring, out, size, true, &need),
+                                (ssize_t)(hdr + len));
+                memcpy(&rec, out, hdr);
+                KUNIT_EXPECT_EQ(test, rec.len, len);
+                KUNIT_EXPECT_EQ(test, memcmp(in, out + hdr, len), 0);
+                KUNIT_EXPECT_EQ(test, head, tail);
+            }
+        }
+
+        head = tail = 0;
+        KUNIT_EXPECT_EQ(test, scull_ring_write(&ring, in, size - hdr + 1, true), (ssize_t)-EMSGSIZE);
+    }
+}
+
+// Разбор записей читателем: сколько целых записей помещается, недописанная
+// mmap-продюсером запись и заголовок, испорченный через mmap
+static void scull_ring_test_record_span(struct kunit *test)
+{
+    const u32 hdr = sizeof(struct scull_record_hdr);
+    struct scull_record_hdr bad = { .len = 1000 };
+    struct scull_ring ring;
+    __u32 head = 0, tail = 0;
+    char buffer[32], in[8] = "abcdefg", out[32];
+    u32 need;
+
+    scull_ring_init(&ring, buffer, sizeof(buffer), &head, &tail);
+    KUNIT_ASSERT_EQ(test, scull_ring_write(&ring, in, 3, true), (ssize_t)3);
+    KUNIT_ASSERT_EQ(test, scull_ring_write(&ring, in, 5, true), (ssize_t)5);
+
+    // Вторая запись не помещается - отдается только первая
+    KUNIT_EXPECT_EQ(test, scull_ring_get_span(&ring, tail, hdr + 3 + hdr + 4, true, &need),
+                    (long)(hdr + 3));
+    KUNIT_EXPECT_EQ(test, need, hdr + 3);
+    KUNIT_EXPECT_EQ(test, scull_ring_get_span(&ring, tail, sizeof(out), true, &need),
+                    (long)(2 * hdr + 8));
+    KUNIT_EXPECT_EQ(test, scull_ring_get_span(&ring, tail, hdr + 2, true, &need), (long)-EMSGSIZE);
+    KUNIT_EXPECT_EQ(test, scull_ring_read(&ring, out, sizeof(out), true, &need), (ssize_t)(2 * hdr + 8));
+
+    // Продюсер опубликовал только часть записи: читать нечего, ждать всю запись
+    KUNIT_ASSERT_EQ(test, scull_ring_write(&ring, in, 7, true), (ssize_t)7);
+    head = scull_ring_advance(&ring, tail, hdr + 2);
+    KUNIT_EXPECT_EQ(test, scull_ring_read(&ring, out, sizeof(out), true, &need), (ssize_t)0);
+    KUNIT_EXPECT_EQ(test, need, hdr + 7);
+    head = scull_ring_advance(&ring, tail, 2);
+    KUNIT_EXPECT_EQ(test, scull_ring_read(&ring, out, sizeof(out), true, &need), (ssize_t)0);
+    KUNIT_EXPECT_EQ(test, need, hdr);
+
+    // Длина больше кольца: -EIO, а не чтение за пределами буфера
+    scull_ring_copy_in(&ring, tail, &bad, hdr);
+    head = scull_ring_advance(&ring, tail, hdr);
+    KUNIT_EXPECT_EQ(test, scull_ring_read(&ring, out, sizeof(out), true, &need), (ssize_t)-EIO);
+
+    // Позиции, испорченные через mmap, приводятся к диапазону [0, 2 * size)
+    head = 5 * sizeof(buffer) + 3;
+    KUNIT_EXPECT_LT(test, scull_ring_load(&ring, ring.head), 2 * (u32)sizeof(buffer));
+}
+
+// Перенос между кольцами разного размера (путь SCULL_IOC_LINK) со всеми
+// сочетаниями заворота источника и приемника
+static void scull_ring_test_move(struct kunit *test)
+{
+    struct scull_ring src, dst;
+    __u32 src_head, src_tail, dst_head, dst_tail;
+    char src_buf[7], dst_buf[8], in[7], out[7];
+    u32 tail, head, len;
+
+    scull_ring_init(&src, src_buf, sizeof(src_buf), &src_head, &src_tail);
+    scull_ring_init(&dst, dst_buf, sizeof(dst_buf), &dst_head, &dst_tail);
+
+    for (tail = 0; tail < 2 * src.size; tail++) {
+        for (head = 0; head < 2 * dst.size; head++) {
+            for (len = 1; len <= src.size; len++) {
+                scull_test_fill(in, len, tail * 7 + head + len);
+                memset(dst_buf, 0, sizeof(dst_buf));
+                scull_ring_copy_in(&src, tail, in, len);
+
+                scull_ring_move(&dst, head, &src, tail, len);
+                scull_ring_copy_out(&dst, head, out, len);
+                KUNIT_ASSERT_EQ(test, memcmp(in, out, len), 0);
+            }
+        }
+    }
+}
+
+static struct kunit_case scull_ring_cases[] = {
+    KUNIT_CASE(scull_ring_test_wrap_stream),
+    KUNIT_CASE(scull_ring_test_wrap_records),
+    KUNIT_CASE(scull_ring_test_record_span),
+    KUNIT_CASE(scull_ring_test_move),
+    {}
+};
+
+static struct kunit_suite scull_ring_suite = {
+    .name = "scull_ring",
+    .test_cases = scull_ring_cases,
+};
+
+/* Устройство: read(2), write(2) и ожидание */
+
+// Свое устройство на каждый тест: первый свободный minor
+static int scull_test_create(struct kunit *test, unsigned long size)
+{
+    int minor = scull_create_device(-1, size, 0, NUMA_NO_NODE);
+
+    if (minor < 0)
+        return minor;
+    test->priv = devices[minor];
+    return 0;
+}
+
+static int scull_dev_test_init(struct kunit *test)
+{
+    return scull_test_create(test, SCULL_TEST_SIZE);
+}
+
+static void scull_dev_test_exit(struct kunit *test)
+{
+    struct scull_ring_buffer *dev = test->priv;
+
+    // Открытых файлов у теста нет: удаление не может вернуть -EBUSY
+    if (dev)
+        KUNIT_EXPECT_EQ(test, scull_destroy_device(MINOR(dev->devno)), 0);
+}
+
+static struct file *scull_test_file(struct kunit *test, unsigned int flags)
+{
+    struct file *filp = kunit_kzalloc(test, sizeof(*filp), GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, filp);
+    filp->private_data = test->priv;
+    filp->f_flags = flags;
+    return filp;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+#define SCULL_TEST_DEST ITER_DEST
+#define SCULL_TEST_SOURCE ITER_SOURCE
+#else
+#define SCULL_TEST_DEST READ
+#define SCULL_TEST_SOURCE WRITE
+#endif
+
+static ssize_t scull_test_read(struct file *filp, void *buf, size_t len)
+{
+    struct kvec kv = { .iov_base = buf, .iov_len = len };
+    struct iov_iter iter;
+    struct kiocb kiocb;
+
+    init_sync_kiocb(&kiocb, filp);
+    iov_iter_kvec(&iter, SCULL_TEST_DEST, &kv, 1, len);
+    return scull_read_iter(&kiocb, &iter);
+}
+
+static ssize_t scull_test_write(struct file *filp, const void *buf, size_t len)
+{
+    struct kvec kv = { .iov_base = (void *)buf, .iov_len = len };
+    struct iov_iter iter;
+    struct kiocb kiocb;
+
+    init_sync_kiocb(&kiocb, filp);
+    iov_iter_kvec(&iter, SCULL_TEST_SOURCE, &kv, 1, len);
+    return scull_write_iter(&kiocb, &iter);
+}
+
+// Память пользователя для ioctl и ITER_UBUF: kunit_vm_mmap (ядро 6.9 и новее)
+// дает потоку теста свое mm. На старых ядрах тест, которому она нужна,
+// пропускается
+static void __user *scull_test_user_buf(struct kunit *test, size_t len)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+    unsigned long addr = kunit_vm_mmap(test, NULL, 0, len, PROT_READ | PROT_WRITE,
+                                       MAP_ANONYMOUS | MAP_PRIVATE, 0);
+
+    if (addr && !IS_ERR_VALUE(addr))
+        return (void __user *)addr;
+#endif
+    return NULL;
+}
+
+// Поток теста: fn выполняется в kthread, которому можно послать SIGUSR1
+struct scull_test_thread {
+    struct task_struct *task;
+    struct completion done;
+    long (*fn)(void *arg);
+    void *arg;
+    long ret;
+};
+
+static int scull_test_thread_fn(void *data)
+{
+    struct scull_test_thread *t = data;
+
+    allow_signal(SIGUSR1);
+    t->ret = t->fn(t->arg);
+    complete(&t->done);
+    return 0;
+}
+
+// Ссылка на task_struct нужна kthread_stop: поток может завершиться раньше
+static int scull_test_start(struct scull_test_thread *t, long (*fn)(void *arg), void *arg,
+                            const char *name, int n)
+{
+    init_completion(&t->done);
+    t->fn = fn;
+    t->arg = arg;
+    t->task = kthread_run(scull_test_thread_fn, t, "%s/%d", name, n);
+    if (IS_ERR(t->task))
+        return PTR_ERR(t->task);
+    get_task_struct(t->task);
+    return 0;
+}
+
+// Ждем окончания fn. Если за timeout не закончилась - прерываем ее сигналом,
+// чтобы не оставить поток в модуле, и возвращаем false
+static bool scull_test_join(struct scull_test_thread *t, unsigned long timeout)
+{
+    bool done = wait_for_completion_timeout(&t->done, timeout);
+
+    if (!done) {
+        send_sig(SIGUSR1, t->task, 1);
+        wait_for_completion(&t->done);
+    }
+    kthread_stop(t->task);
+    put_task_struct(t->task);
+    return done;
+}
+
+// Ждем, пока счетчик спящих в странице управления не станет равен want
+static bool scull_test_wait_sleepers(const __u32 *waiters, u32 want)
+{
+    unsigned long timeout = jiffies + SCULL_TEST_TIMEOUT;
+
+    while (READ_ONCE(*waiters) != want) {
+        if (time_after(jiffies, timeout))
+            return false;
+        msleep(1);
+    }
+    return true;
+}
+
+static int scull_test_count_done(struct scull_test_thread *t, int n)
+{
+    int i, done = 0;
+
+    for (i = 0; i < n; i++)
+        done += completion_done(&t[i].done);
+    return done;
+}
+
+// Один вызов read(2) или write(2) в потоке
+struct scull_test_io {
+    struct file *filp;
+    char *buf;
+    size_t len;
+};
+
+static long scull_test_read_fn(void *arg)
+{
+    struct scull_test_io *io = arg;
+
+    return scull_test_read(io->filp, io->buf, io->len);
+}
+
+static long scull_test_write_fn(void *arg)
+{
+    struct scull_test_io *io = arg;
+
+    return scull_test_write(io->filp, io->buf, io->len);
+}
+
+// Заворот через read(2)/write(2): вторая запись проходит через конец буфера
+static void scull_dev_test_rw_wrap(struct kunit *test)
+{
+    struct scull_ring_buffer *dev = test->priv;
+    struct file *filp = scull_test_file(test, O_NONBLOCK);
+    size_t part = SCULL_TEST_SIZE * 3 / 4;
+    char *in = kunit_kmalloc(test, part, GFP_KERNEL);
+    char *out = kunit_kmalloc(test, SCULL_TEST_SIZE, GFP_KERNEL);
+    int round;
+
+    KUNIT_ASSERT_NOT_NULL(test, in);
+    KUNIT_ASSERT_NOT_NULL(test, out);
+
+    for (round = 0; round < 4; round++) {
+        scull_test_fill(in, part, round * part);
+        KUNIT_ASSERT_EQ(test, scull_test_write(filp, in, part), (ssize_t)part);
+        KUNIT_EXPECT_EQ(test, scull_data_size(dev), (u32)part);
+        KUNIT_ASSERT_EQ(test, scull_test_read(filp, out, SCULL_TEST_SIZE), (ssize_t)part);
+        KUNIT_EXPECT_EQ(test, memcmp(in, out, part), 0);
+    }
+    KUNIT_EXPECT_LT(test, READ_ONCE(dev->ctrl->head), 2u * SCULL_TEST_SIZE);
+
+    // Поток: write(2) кладет столько, сколько помещается
+    scull_test_fill(in, part, 0);
+    KUNIT_EXPECT_EQ(test, scull_test_write(filp, in, part), (ssize_t)part);
+    KUNIT_EXPECT_EQ(test, scull_test_write(filp, in, part), (ssize_t)(SCULL_TEST_SIZE - part));
+    KUNIT_EXPECT_EQ(test, scull_data_size(dev), (u32)SCULL_TEST_SIZE);
+}
+
+// O_NONBLOCK: пустой и полный буфер, запись больше кольца, буфер чтения
+// меньше записи
+static void scull_dev_test_nonblock(struct kunit *test)
+{
+    struct scull_ring_buffer *dev = test->priv;
+    struct file *filp = scull_test_file(test, O_NONBLOCK);
+    char *buf = kunit_kzalloc(test, SCULL_TEST_SIZE + 1, GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+
+    KUNIT_EXPECT_EQ(test, scull_test_read(filp, buf, 1), (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_EQ(test, SCULL_STAT_SUM(dev, read_eagain), 1ULL);
+    KUNIT_ASSERT_EQ(test, scull_test_write(filp, buf, SCULL_TEST_SIZE), (ssize_t)SCULL_TEST_SIZE);
+    KUNIT_EXPECT_EQ(test, scull_test_write(filp, buf, 1), (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_EQ(test, SCULL_STAT_SUM(dev, write_eagain), 1ULL);
+    KUNIT_ASSERT_EQ(test, scull_test_read(filp, buf, SCULL_TEST_SIZE), (ssize_t)SCULL_TEST_SIZE);
+    // Нулевая длина - не ошибка даже на пустом буфере
+    KUNIT_EXPECT_EQ(test, scull_test_read(filp, buf, 0), (ssize_t)0);
+
+    KUNIT_ASSERT_EQ(test, scull_set_mode(dev, SCULL_MODE_RECORD), 0);
+    KUNIT_EXPECT_EQ(test, scull_test_write(filp, buf, SCULL_TEST_SIZE), (ssize_t)-EMSGSIZE);
+    KUNIT_ASSERT_EQ(test, scull_test_write(filp, buf, 100), (ssize_t)100);
+    KUNIT_EXPECT_EQ(test, scull_test_read(filp, buf, 100), (ssize_t)-EMSGSIZE);
+    // Неудачное чтение запись не трогает
+    KUNIT_EXPECT_EQ(test, scull_test_read(filp, buf, SCULL_TEST_SIZE),
+                    (ssize_t)(sizeof(struct scull_record_hdr) + 100));
+    KUNIT_EXPECT_EQ(test, scull_data_size(dev), 0u);
+}
+
+// Буфер read(2) меньше первой записи: -EMSGSIZE сразу, без сна и без
+// копирования - даже в блокирующем режиме. Если целиком помещается только
+// часть записей, отдаются они
+static void scull_dev_test_record_short(struct kunit *test)
+{
+    const size_t hdr = sizeof(struct scull_record_hdr);
+    struct scull_ring_buffer *dev = test->priv;
+    struct file *filp = scull_test_file(test, 0);
+    char *buf = kunit_kzalloc(test, SCULL_TEST_SIZE, GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+    KUNIT_ASSERT_EQ(test, scull_set_mode(dev, SCULL_MODE_RECORD), 0);
+    KUNIT_ASSERT_EQ(test, scull_test_write(filp, buf, 10), (ssize_t)10);
+    KUNIT_ASSERT_EQ(test, scull_test_write(filp, buf, 20), (ssize_t)20);
+
+    KUNIT_EXPECT_EQ(test, scull_test_read(filp, buf, hdr + 9), (ssize_t)-EMSGSIZE);
+    KUNIT_EXPECT_EQ(test, scull_test_read(filp, buf, 1), (ssize_t)-EMSGSIZE);
+    KUNIT_EXPECT_EQ(test, scull_data_size(dev), (u32)(2 * hdr + 30));
+
+    KUNIT_EXPECT_EQ(test, scull_test_read(filp, buf, 2 * hdr + 29), (ssize_t)(hdr + 10));
+    KUNIT_EXPECT_EQ(test, scull_test_read(filp, buf, hdr + 19), (ssize_t)-EMSGSIZE);
+    KUNIT_EXPECT_EQ(test, scull_test_read(filp, buf, hdr + 20), (ssize_t)(hdr + 20));
+    KUNIT_EXPECT_EQ(test, scull_data_size(dev), 0u);
+    KUNIT_EXPECT_EQ(test, SCULL_STAT_SUM(dev, read_sleeps), 0ULL);
+}
+
+// В режиме записей poll не сообщает EPOLLOUT, пока не влезает заголовок и
+// байт данных, и учитывает порог write_high
+static void scull_dev_test_poll_out(struct kunit *test)
+{
+    const size_t hdr = sizeof(struct scull_record_hdr);
+    struct scull_ring_buffer *dev = test->priv;
+    struct file *filp = scull_test_file(test, O_NONBLOCK);
+    char *buf = kunit_kzalloc(test, SCULL_TEST_SIZE, GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+    KUNIT_ASSERT_EQ(test, scull_set_mode(dev, SCULL_MODE_RECORD), 0);
+    KUNIT_ASSERT_EQ(test, scull_test_write(filp, buf, SCULL_TEST_SIZE - 2 * hdr),
+                    (ssize_t)(SCULL_TEST_SIZE - 2 * hdr));
+    KUNIT_EXPECT_FALSE(test, scull_poll_mask(dev) & EPOLLOUT);
+    KUNIT_EXPECT_EQ(test, scull_test_write(filp, buf, 1), (ssize_t)-EAGAIN);
+
+    KUNIT_ASSERT_EQ(test, scull_test_read(filp, buf, SCULL_TEST_SIZE),
+                    (ssize_t)(SCULL_TEST_SIZE - hdr));
+    KUNIT_EXPECT_TRUE(test, scull_poll_mask(dev) & EPOLLOUT);
+
+    WRITE_ONCE(dev->write_wmark, SCULL_TEST_SIZE / 2);
+    KUNIT_ASSERT_EQ(test, scull_test_write(filp, buf, SCULL_TEST_SIZE / 2),
+                    (ssize_t)(SCULL_TEST_SIZE / 2));
+    KUNIT_EXPECT_FALSE(test, scull_poll_mask(dev) & EPOLLOUT);
+}
+
+// То же в режиме под-колец: запись, не влезающая в буфер, лежит в под-кольце,
+// которое обход проходит первым, а последними идут пустые. read(2) должен
+// вернуть -EMSGSIZE, а не -EAGAIN или бесконечный цикл ожидания
+static void scull_dev_test_percpu_short(struct kunit *test)
+{
+    struct scull_ring_buffer *dev = test->priv;
+    struct scull_test_io io;
+    struct scull_test_thread t;
+    struct file *filp;
+    char *buf;
+    int cpu;
+
+    // Под-кольца кольца теста на многих CPU вышли бы меньше MIN_SUBRING_SIZE
+    test->priv = NULL;
+    KUNIT_ASSERT_EQ(test, scull_destroy_device(MINOR(dev->devno)), 0);
+    KUNIT_ASSERT_EQ(test, scull_test_create(test, SCULL_STRESS_SIZE), 0);
+    dev = test->priv;
+    if (scull_set_mode(dev, SCULL_MODE_RECORD | SCULL_MODE_PERCPU))
+        kunit_skip(test, "sub-rings too small for %u CPUs", nr_cpu_ids);
+
+    filp = scull_test_file(test, O_NONBLOCK);
+    buf = kunit_kzalloc(test, 100, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+    KUNIT_ASSERT_EQ(test, scull_test_write(filp, buf, 100), (ssize_t)100);
+
+    // Обход начинается с под-кольца, в котором лежит запись
+    for_each_possible_cpu(cpu)
+        if (scull_ring_data_size(&per_cpu_ptr(dev->subrings, cpu)->ring))
+            dev->drain_cpu = cpu;
+
+    KUNIT_EXPECT_EQ(test, scull_test_read(filp, buf, 50), (ssize_t)-EMSGSIZE);
+
+    io.filp = scull_test_file(test, 0);
+    io.buf = buf;
+    io.len = 50;
+    KUNIT_ASSERT_EQ(test, scull_test_start(&t, scull_test_read_fn, &io, "scull_pcpu", 0), 0);
+    KUNIT_EXPECT_TRUE(test, scull_test_join(&t, SCULL_TEST_TIMEOUT));
+    KUNIT_EXPECT_EQ(test, t.ret, (long)-EMSGSIZE);
+
+    KUNIT_EXPECT_EQ(test, scull_test_read(filp, buf, 100 + sizeof(struct scull_record_hdr)),
+                    (ssize_t)(100 + sizeof(struct scull_record_hdr)));
+}
+
+// SCULL_IOC_PEEK: запрос и буфер для данных лежат в одной странице пользователя
+static long scull_test_peek(struct kunit *test, struct file *filp,
+                            struct scull_peek __user *ureq, u32 offset, u32 len)
+{
+    struct scull_peek req = {
+        .buf = (u64)(unsigned long)(ureq + 1),
+        .len = len,
+        .offset = offset,
+    };
+
+    KUNIT_ASSERT_EQ(test, copy_to_user(ureq, &req, sizeof(req)), 0UL);
+    return scull_peek(test->priv, filp, ureq);
+}
+
+// Просмотр в режиме записей: offset посреди записи - -EINVAL. Данные записи
+// подобраны так, что со смещения 1 они читаются как заголовок пустой записи
+static void scull_dev_test_peek_offset(struct kunit *test)
+{
+    const u32 one = sizeof(struct scull_record_hdr) + 8;
+    struct scull_ring_buffer *dev = test->priv;
+    struct file *filp = scull_test_file(test, O_NONBLOCK);
+    struct scull_peek __user *ureq = scull_test_user_buf(test, PAGE_SIZE);
+    static const char payload[8] = { 0, 0, 0, 0, 'a', 'b', 'c', 'd' };
+
+    if (!ureq)
+        kunit_skip(test, "no user memory for ioctl arguments");
+
+    KUNIT_ASSERT_EQ(test, scull_set_mode(dev, SCULL_MODE_RECORD), 0);
+    KUNIT_ASSERT_EQ(test, scull_test_write(filp, payload, 8), (ssize_t)8);
+    KUNIT_ASSERT_EQ(test, scull_test_write(filp, payload, 8), (ssize_t)8);
+
+    KUNIT_EXPECT_EQ(test, scull_test_peek(test, filp, ureq, 0, 64), (long)(2 * one));
+    KUNIT_EXPECT_EQ(test, scull_test_peek(test, filp, ureq, 1, 64), (long)-EINVAL);
+    KUNIT_EXPECT_EQ(test, scull_test_peek(test, filp, ureq, one - 1, 64), (long)-EINVAL);
+    KUNIT_EXPECT_EQ(test, scull_test_peek(test, filp, ureq, one, 64), (long)one);
+    KUNIT_EXPECT_EQ(test, scull_test_peek(test, filp, ureq, 2 * one, 64), (long)-EAGAIN);
+    // Просмотр ничего не извлекает
+    KUNIT_EXPECT_EQ(test, scull_data_size(dev), 2 * one);
+    KUNIT_EXPECT_EQ(test, scull_commit(dev, 1), (long)-EINVAL);
+    KUNIT_EXPECT_EQ(test, scull_commit(dev, one), 0L);
+}
+
+// Читатель спит на пустом буфере и получает данные первой же записи
+static void scull_dev_test_block_read(struct kunit *test)
+{
+    struct scull_ring_buffer *dev = test->priv;
+    struct scull_test_io io = {
+        .filp = scull_test_file(test, 0),
+        .buf = kunit_kzalloc(test, 16, GFP_KERNEL),
+        .len = 16,
+    };
+    struct scull_test_thread t;
+
+    KUNIT_ASSERT_NOT_NULL(test, io.buf);
+    KUNIT_ASSERT_EQ(test, scull_test_start(&t, scull_test_read_fn, &io, "scull_rd", 0), 0);
+
+    KUNIT_EXPECT_TRUE(test, scull_test_wait_sleepers(&dev->ctrl->read_waiters, 1));
+    KUNIT_EXPECT_FALSE(test, completion_done(&t.done));
+
+    KUNIT_EXPECT_EQ(test, scull_test_write(scull_test_file(test, 0), "hello", 5), (ssize_t)5);
+    KUNIT_EXPECT_TRUE(test, scull_test_join(&t, SCULL_TEST_TIMEOUT));
+    KUNIT_EXPECT_EQ(test, t.ret, 5L);
+    KUNIT_EXPECT_EQ(test, memcmp(io.buf, "hello", 5), 0);
+    KUNIT_EXPECT_EQ(test, READ_ONCE(dev->ctrl->read_waiters), 0u);
+}
+
+// Писатель спит на полном буфере, пока чтение не освободит место
+static void scull_dev_test_block_write(struct kunit *test)
+{
+    struct scull_ring_buffer *dev = test->priv;
+    struct file *filp = scull_test_file(test, 0);
+    char *buf = kunit_kzalloc(test, SCULL_TEST_SIZE, GFP_KERNEL);
+    struct scull_test_io io = { .filp = filp, .buf = buf, .len = 8 };
+    struct scull_test_thread t;
+
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+    KUNIT_ASSERT_EQ(test, scull_test_write(filp, buf, SCULL_TEST_SIZE), (ssize_t)SCULL_TEST_SIZE);
+    KUNIT_ASSERT_EQ(test, scull_test_start(&t, scull_test_write_fn, &io, "scull_wr", 0), 0);
+
+    KUNIT_EXPECT_TRUE(test, scull_test_wait_sleepers(&dev->ctrl->write_waiters, 1));
+    KUNIT_EXPECT_FALSE(test, completion_done(&t.done));
+
+    KUNIT_EXPECT_EQ(test, scull_test_read(filp, buf, SCULL_TEST_SIZE / 2), (ssize_t)(SCULL_TEST_SIZE / 2));
+    KUNIT_EXPECT_TRUE(test, scull_test_join(&t, SCULL_TEST_TIMEOUT));
+    KUNIT_EXPECT_EQ(test, t.ret, 8L);
+    KUNIT_EXPECT_EQ(test, scull_data_size(dev), (u32)(SCULL_TEST_SIZE / 2 + 8));
+}
+
+// Сигнал прерывает сон с -ERESTARTSYS, не трогая данные и счетчики спящих
+static void scull_dev_test_signal(struct kunit *test)
+{
+    struct scull_ring_buffer *dev = test->priv;
+    struct file *filp = scull_test_file(test, 0);
+    char *buf = kunit_kzalloc(test, SCULL_TEST_SIZE, GFP_KERNEL);
+    struct scull_test_io io = { .filp = filp, .buf = buf, .len = 8 };
+    struct scull_test_thread t;
+
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+
+    KUNIT_ASSERT_EQ(test, scull_test_start(&t, scull_test_read_fn, &io, "scull_rd", 0), 0);
+    KUNIT_EXPECT_TRUE(test, scull_test_wait_sleepers(&dev->ctrl->read_waiters, 1));
+    send_sig(SIGUSR1, t.task, 1);
+    KUNIT_EXPECT_TRUE(test, scull_test_join(&t, SCULL_TEST_TIMEOUT));
+    KUNIT_EXPECT_EQ(test, t.ret, (long)-ERESTARTSYS);
+    KUNIT_EXPECT_EQ(test, READ_ONCE(dev->ctrl->read_waiters), 0u);
+
+    KUNIT_ASSERT_EQ(test, scull_test_write(filp, buf, SCULL_TEST_SIZE), (ssize_t)SCULL_TEST_SIZE);
+    KUNIT_ASSERT_EQ(test, scull_test_start(&t, scull_test_write_fn, &io, "scull_wr", 0), 0);
+    KUNIT_EXPECT_TRUE(test, scull_test_wait_sleepers(&dev->ctrl->write_waiters, 1));
+    send_sig(SIGUSR1, t.task, 1);
+    KUNIT_EXPECT_TRUE(test, scull_test_join(&t, SCULL_TEST_TIMEOUT));
+    KUNIT_EXPECT_EQ(test, t.ret, (long)-ERESTARTSYS);
+    KUNIT_EXPECT_EQ(test, READ_ONCE(dev->ctrl->write_waiters), 0u);
+    KUNIT_EXPECT_EQ(test, scull_data_size(dev), (u32)SCULL_TEST_SIZE);
+}
+
+// SCULL_MODE_WORKQUEUE: одна запись на read(2) и одно пробуждение на запись
+static void scull_dev_test_workqueue(struct kunit *test)
+{
+    const size_t one = sizeof(struct scull_record_hdr) + 4;
+    struct scull_ring_buffer *dev = test->priv;
+    struct file *filp = scull_test_file(test, O_NONBLOCK);
+    struct scull_test_io io[3];
+    struct scull_test_thread t[3];
+    unsigned long deadline;
+    char buf[64];
+    int i, n;
+
+    KUNIT_EXPECT_EQ(test, scull_set_mode(dev, SCULL_MODE_WORKQUEUE | SCULL_MODE_PERCPU), -EINVAL);
+    KUNIT_EXPECT_EQ(test, scull_set_mode(dev, SCULL_MODE_WORKQUEUE | SCULL_MODE_OVERWRITE), -EINVAL);
+    KUNIT_ASSERT_EQ(test, scull_set_mode(dev, SCULL_MODE_RECORD | SCULL_MODE_WORKQUEUE), 0);
+
+    // Две записи в буфере, но read(2) отдает одну
+    KUNIT_ASSERT_EQ(test, scull_test_write(filp, "abcd", 4), (ssize_t)4);
+    KUNIT_ASSERT_EQ(test, scull_test_write(filp, "efgh", 4), (ssize_t)4);
+    KUNIT_EXPECT_EQ(test, scull_test_read(filp, buf, sizeof(buf)), (ssize_t)one);
+    KUNIT_EXPECT_EQ(test, memcmp(buf + sizeof(struct scull_record_hdr), "abcd", 4), 0);
+    KUNIT_EXPECT_EQ(test, scull_test_read(filp, buf, sizeof(buf)), (ssize_t)one);
+    KUNIT_EXPECT_EQ(test, memcmp(buf + sizeof(struct scull_record_hdr), "efgh", 4), 0);
+
+    for (i = 0; i < 3; i++) {
+        io[i].filp = scull_test_file(test, 0);
+        io[i].buf = kunit_kzalloc(test, 64, GFP_KERNEL);
+        io[i].len = 64;
+        KUNIT_ASSERT_NOT_NULL(test, io[i].buf);
+        KUNIT_ASSERT_EQ(test, scull_test_start(&t[i], scull_test_read_fn, &io[i], "scull_wq", i), 0);
+    }
+    KUNIT_EXPECT_TRUE(test, scull_test_wait_sleepers(&dev->ctrl->read_waiters, 3));
+
+    // Каждая запись будит ровно одного работника. Проснувшиеся без работы
+    // уснули бы снова - read_sleeps это покажет
+    for (n = 1; n <= 2; n++) {
+        KUNIT_EXPECT_EQ(test, scull_test_write(filp, "1234", 4), (ssize_t)4);
+        KUNIT_EXPECT_TRUE(test, scull_test_wait_sleepers(&dev->ctrl->read_waiters, 3 - n));
+        deadline = jiffies + SCULL_TEST_TIMEOUT;
+        while (scull_test_count_done(t, 3) < n && time_before(jiffies, deadline))
+            msleep(1);
+        KUNIT_EXPECT_EQ(test, scull_test_count_done(t, 3), n);
+    }
+    msleep(20);
+    KUNIT_EXPECT_EQ(test, scull_test_count_done(t, 3), 2);
+    KUNIT_EXPECT_EQ(test, SCULL_STAT_SUM(dev, read_sleeps), 3ULL);
+    KUNIT_EXPECT_EQ(test, scull_data_size(dev), 0u);
+
+    KUNIT_EXPECT_EQ(test, scull_test_write(filp, "9abc", 4), (ssize_t)4);
+    for (i = 0; i < 3; i++) {
+        KUNIT_EXPECT_TRUE(test, scull_test_join(&t[i], SCULL_TEST_TIMEOUT));
+        KUNIT_EXPECT_EQ(test, t[i].ret, (long)one);
+    }
+}
+
+// read(2) в память пользователя (ITER_UBUF): поток берет mm теста, в котором
+// буфер выделил kunit_vm_mmap
+struct scull_test_uread {
+    struct file *filp;
+    struct mm_struct *mm;
+    void __user *buf;
+    size_t len;
+};
+
+static long scull_test_uread_fn(void *arg)
+{
+    struct scull_test_uread *io = arg;
+    struct iov_iter iter;
+    struct kiocb kiocb;
+    long ret;
+
+    kthread_use_mm(io->mm);
+    init_sync_kiocb(&kiocb, io->filp);
+    iov_iter_ubuf(&iter, SCULL_TEST_DEST, io->buf, io->len);
+    ret = scull_read_iter(&kiocb, &iter);
+    kthread_unuse_mm(io->mm);
+    return ret;
+}
+
+static u64 scull_test_residency(struct scull_ring_buffer *dev)
+{
+    u64 sum = 0;
+    int i;
+
+    for (i = 0; i < SCULL_HIST_BUCKETS; i++)
+        sum += SCULL_STAT_SUM(dev, residency_us[i]);
+    return sum;
+}
+
+// Прямая передача: читатель спит на пустом кольце с закрепленным буфером
+// пользователя, писатель копирует туда сам. Буфер не выровнен и занимает две
+// страницы. Остаток потока уходит в кольцо; запись с меткой времени
+// попадает в гистограмму времени в очереди, как прочитанная из кольца
+static void scull_dev_test_handoff(struct kunit *test)
+{
+    const size_t hdr = sizeof(struct scull_record_hdr) + sizeof(__u64);
+    const size_t part = SCULL_TEST_SIZE / 2, rec = 100;
+    struct scull_ring_buffer *dev = test->priv;
+    struct file *filp = scull_test_file(test, O_NONBLOCK);
+    char __user *ubuf = scull_test_user_buf(test, 2 * SCULL_TEST_SIZE);
+    struct scull_test_uread io = {
+        .filp = scull_test_file(test, 0),
+        .buf = ubuf + 100,
+        .len = SCULL_TEST_SIZE,
+    };
+    char *in = kunit_kmalloc(test, SCULL_TEST_SIZE + part, GFP_KERNEL);
+    char *out = kunit_kmalloc(test, SCULL_TEST_SIZE, GFP_KERNEL);
+    struct scull_record_hdr rhdr;
+    struct scull_test_thread t;
+    unsigned int old_min = READ_ONCE(handoff_min);
+
+    KUNIT_ASSERT_NOT_NULL(test, in);
+    KUNIT_ASSERT_NOT_NULL(test, out);
+    if (!ubuf)
+        kunit_skip(test, "no user memory for ITER_UBUF");
+
+    // Порог ниже записи в 100 байт, чтобы передать и ее. Дальше только
+    // EXPECT: порог надо вернуть
+    WRITE_ONCE(handoff_min, 64);
+    io.mm = current->mm;
+    scull_test_fill(in, SCULL_TEST_SIZE + part, 0);
+
+    if (!scull_test_start(&t, scull_test_uread_fn, &io, "scull_hand", 0)) {
+        KUNIT_EXPECT_TRUE(test, scull_test_wait_sleepers(&dev->ctrl->read_waiters, 1));
+        KUNIT_EXPECT_NOT_NULL(test, READ_ONCE(dev->handoff));
+        KUNIT_EXPECT_EQ(test, scull_test_write(filp, in, SCULL_TEST_SIZE + part),
+                        (ssize_t)(SCULL_TEST_SIZE + part));
+        KUNIT_EXPECT_TRUE(test, scull_test_join(&t, SCULL_TEST_TIMEOUT));
+        KUNIT_EXPECT_EQ(test, t.ret, (long)SCULL_TEST_SIZE);
+    }
+    KUNIT_EXPECT_EQ(test, SCULL_STAT_SUM(dev, direct_bytes), (u64)SCULL_TEST_SIZE);
+    KUNIT_EXPECT_NULL(test, READ_ONCE(dev->handoff));
+    KUNIT_EXPECT_EQ(test, copy_from_user(out, io.buf, SCULL_TEST_SIZE), 0UL);
+    KUNIT_EXPECT_EQ(test, memcmp(in, out, SCULL_TEST_SIZE), 0);
+    KUNIT_EXPECT_EQ(test, scull_test_read(filp, out, SCULL_TEST_SIZE), (ssize_t)part);
+    KUNIT_EXPECT_EQ(test, memcmp(in + SCULL_TEST_SIZE, out, part), 0);
+
+    KUNIT_EXPECT_EQ(test, scull_set_mode(dev, SCULL_MODE_RECORD | SCULL_MODE_TIMESTAMP), 0);
+    if (!scull_test_start(&t, scull_test_uread_fn, &io, "scull_hand", 1)) {
+        KUNIT_EXPECT_TRUE(test, scull_test_wait_sleepers(&dev->ctrl->read_waiters, 1));
+        KUNIT_EXPECT_EQ(test, scull_test_write(filp, in, rec), (ssize_t)rec);
+        KUNIT_EXPECT_TRUE(test, scull_test_join(&t, SCULL_TEST_TIMEOUT));
+        KUNIT_EXPECT_EQ(test, t.ret, (long)(hdr + rec));
+    }
+    KUNIT_EXPECT_EQ(test, SCULL_STAT_SUM(dev, direct_bytes), (u64)(SCULL_TEST_SIZE + rec));
+    KUNIT_EXPECT_EQ(test, scull_test_residency(dev), 1ULL);
+    KUNIT_EXPECT_EQ(test, scull_data_size(dev), 0u);
+    KUNIT_EXPECT_EQ(test, copy_from_user(&rhdr, io.buf, sizeof(rhdr)), 0UL);
+    KUNIT_EXPECT_EQ(test, rhdr.len, (__u32)(sizeof(__u64) + rec));
+    KUNIT_EXPECT_EQ(test, copy_from_user(out, io.buf + hdr, rec), 0UL);
+    KUNIT_EXPECT_EQ(test, memcmp(in, out, rec), 0);
+
+    WRITE_ONCE(handoff_min, old_min);
+}
+
+// Откат при ошибках загрузки: неверные параметры и устройство, которое не
+// удалось создать посреди цикла - созданные до него должны исчезнуть
+static void scull_dev_test_init_unwind(struct kunit *test)
+{
+    int saved_devices = num_devices, saved_size = buffer_size, saved_ms = telemetry_ms;
+    int first = MAX_DEVICES - 3, i, err;
+
+    KUNIT_EXPECT_EQ(test, scull_check_params(), 0);
+    num_devices = MAX_DEVICES + 1;
+    KUNIT_EXPECT_EQ(test, scull_check_params(), -EINVAL);
+    num_devices = saved_devices;
+    buffer_size = 0;
+    KUNIT_EXPECT_EQ(test, scull_check_params(), -EINVAL);
+    buffer_size = saved_size;
+    telemetry_ms = MAX_TELEMETRY_MS + 1;
+    KUNIT_EXPECT_EQ(test, scull_check_params(), -EINVAL);
+    telemetry_ms = saved_ms;
+
+    // Ошибки до регистрации устройства: таблица не меняется
+    KUNIT_EXPECT_EQ(test, scull_create_device(first, 0, 0, NUMA_NO_NODE), -EINVAL);
+    KUNIT_EXPECT_EQ(test, scull_create_device(first, 64, SCULL_MODE_TIMESTAMP, NUMA_NO_NODE), -EINVAL);
+    KUNIT_EXPECT_EQ(test, scull_create_device(MAX_DEVICES, 64, 0, NUMA_NO_NODE), -EINVAL);
+    // Неудачное создание после выбора minor возвращает его
+    KUNIT_EXPECT_FALSE(test, test_bit(first, scull_minors_reserved));
+
+    mutex_lock(&scull_devices_lock);
+    for (i = first; i < MAX_DEVICES; i++)
+        if (devices[i])
+            break;
+    mutex_unlock(&scull_devices_lock);
+    if (i < MAX_DEVICES)
+        kunit_skip(test, "minor %d is in use", i);
+    KUNIT_EXPECT_NULL(test, devices[first]);
+
+    // Третье устройство занято заранее: первые два должны быть удалены
+    KUNIT_ASSERT_EQ(test, scull_create_device(first + 2, 64, 0, NUMA_NO_NODE), first + 2);
+    err = scull_create_devices(first, 3, 64, 0);
+    KUNIT_EXPECT_EQ(test, err, -EEXIST);
+    KUNIT_EXPECT_NULL(test, devices[first]);
+    KUNIT_EXPECT_NULL(test, devices[first + 1]);
+    KUNIT_EXPECT_EQ(test, scull_destroy_device(first + 2), 0);
+
+    KUNIT_ASSERT_EQ(test, scull_create_devices(first, 3, 64, SCULL_MODE_RECORD), 0);
+    for (i = first; i < MAX_DEVICES; i++)
+        KUNIT_EXPECT_EQ(test, READ_ONCE(devices[i]->mode), (u32)SCULL_MODE_RECORD);
+    scull_remove_devices(first, 3);
+    for (i = first; i < MAX_DEVICES; i++)
+        KUNIT_EXPECT_NULL(test, devices[i]);
+}
+
+static struct kunit_case scull_dev_cases[] = {
+    KUNIT_CASE(scull_dev_test_rw_wrap),
+    KUNIT_CASE(scull_dev_test_nonblock),
+    KUNIT_CASE(scull_dev_test_record_short),
+    KUNIT_CASE(scull_dev_test_poll_out),
+    KUNIT_CASE(scull_dev_test_percpu_short),
+    KUNIT_CASE(scull_dev_test_peek_offset),
+    KUNIT_CASE(scull_dev_test_block_read),
+    KUNIT_CASE(scull_dev_test_block_write),
+    KUNIT_CASE(scull_dev_test_signal),
+    KUNIT_CASE(scull_dev_test_workqueue),
+    KUNIT_CASE(scull_dev_test_handoff),
+    KUNIT_CASE(scull_dev_test_init_unwind),
+    {}
+};
+
+static struct kunit_suite scull_dev_suite = {
+    .name = "scull_ring_buffer",
+    .init = scull_dev_test_init,
+    .exit = scull_dev_test_exit,
+    .test_cases = scull_dev_cases,
+};
+
+/* Многопоточный стресс и пропускная способность */
+
+struct scull_stress_param {
+    const char *name;
+    u32 mode;
+    int producers;
+    int consumers;
+    u32 ops;            // Сколько write(2) делает каждый писатель
+    u32 msg_size;       // Наибольший размер сообщения
+};
+
+// Запись стресса: заголовок данных, остаток - scull_test_byte(seq + i)
+struct scull_stress_rec {
+    u32 producer;
+    u32 pad;
+    u64 seq;
+};
+
+struct scull_stress {
+    const struct scull_stress_param *p;
+    struct kunit *test;
+    atomic64_t written;         // Записей (в потоковом режиме - байт) записано
+    atomic64_t consumed;        // и прочитано
+    atomic64_t seq_sum[SCULL_STRESS_MAX_THREADS];
+    atomic_t failures;
+    bool stop;
+};
+
+struct scull_stress_worker {
+    struct scull_stress *st;
+    struct file *filp;
+    int id;
+};
+
+static void scull_stress_fail(struct scull_stress *st, const char *what, u64 a, u64 b)
+{
+    if (atomic_inc_return(&st->failures) <= 10)
+        kunit_err(st->test, "%s: %llu vs %llu\n", what, a, b);
+}
+
+static inline u32 scull_stress_rand(u32 *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+static long scull_stress_producer(void *arg)
+{
+    struct scull_stress_worker *w = arg;
+    struct scull_stress *st = w->st;
+    const struct scull_stress_param *p = st->p;
+    bool record = p->mode & SCULL_MODE_RECORD;
+    u32 min = record ? sizeof(struct scull_stress_rec) : 1;
+    u32 rnd = 0x9e3779b9 * (w->id + 1);
+    char *buf = kmalloc(p->msg_size, GFP_KERNEL);
+    u64 offset = 0, seq;
+    ssize_t ret = 0;
+    u32 len;
+
+    if (!buf)
+        return -ENOMEM;
+
+    for (seq = 0; seq < p->ops; seq++) {
+        len = min + scull_stress_rand(&rnd) % (p->msg_size - min + 1);
+        if (record) {
+            struct scull_stress_rec rec = { .producer = w->id, .seq = seq };
+
+            memcpy(buf, &rec, sizeof(rec));
+            scull_test_fill(buf + sizeof(rec), len - sizeof(rec), seq + sizeof(rec));
+        } else {
+            scull_test_fill(buf, len, offset);
+        }
+
+        ret = scull_test_write(w->filp, buf, len);
+        if (ret <= 0 || (record && ret != (ssize_t)len)) {
+            scull_stress_fail(st, "write", ret, len);
+            break;
+        }
+        // В потоке продолжаем с того места, где write(2) остановился
+        offset += ret;
+        atomic64_add(record ? 1 : ret, &st->written);
+    }
+
+    kfree(buf);
+    return ret < 0 ? ret : 0;
+}
+
+// Проверка прочитанного. Внутри одного читателя записи каждого писателя идут
+// по возрастанию seq (кроме под-колец: писатель мог сменить CPU)
+static void scull_stress_verify(struct scull_stress *st, const char *buf, size_t len,
+                                u64 *next_seq, u64 *offset)
+{
+    const struct scull_stress_param *p = st->p;
+    size_t off = 0, i;
+    u32 records = 0;
+
+    if (!(p->mode & SCULL_MODE_RECORD)) {
+        for (i = 0; i < len; i++)
+            if ((u8)buf[i] != scull_test_byte(*offset + i)) {
+                scull_stress_fail(st, "stream byte at offset", *offset + i, (u8)buf[i]);
+                break;
+            }
+        *offset += len;
+        atomic64_add(len, &st->consumed);
+        return;
+    }
+
+    while (off < len) {
+        struct scull_record_hdr hdr;
+        struct scull_stress_rec rec;
+
+        memcpy(&hdr, buf + off, sizeof(hdr));
+        off += sizeof(hdr);
+        if (hdr.len < sizeof(rec) || hdr.len > len - off) {
+            scull_stress_fail(st, "record length", hdr.len, len - off);
+            return;
+        }
+        memcpy(&rec, buf + off, sizeof(rec));
+        if (rec.producer >= p->producers) {
+            scull_stress_fail(st, "record producer", rec.producer, p->producers);
+            return;
+        }
+        if (!(p->mode & SCULL_MODE_PERCPU) && rec.seq < next_seq[rec.producer])
+            scull_stress_fail(st, "record sequence", rec.seq, next_seq[rec.producer]);
+        next_seq[rec.producer] = rec.seq + 1;
+        for (i = sizeof(rec); i < hdr.len; i++)
+            if ((u8)buf[off + i] != scull_test_byte(rec.seq + i)) {
+                scull_stress_fail(st, "record byte", i, (u8)buf[off + i]);
+                break;
+            }
+        atomic64_add(rec.seq, &st->seq_sum[rec.producer]);
+        off += hdr.len;
+        records++;
+    }
+    if ((p->mode & SCULL_MODE_WORKQUEUE) && records != 1)
+        scull_stress_fail(st, "records per read", records, 1);
+    atomic64_add(records, &st->consumed);
+}
+
+// Читатель работает до stop. Из сна его выводит SIGUSR1
+static long scull_stress_consumer(void *arg)
+{
+    struct scull_stress_worker *w = arg;
+    struct scull_stress *st = w->st;
+    size_t cap = st->p->msg_size * 4 + sizeof(struct scull_record_hdr);
+    char *buf = kmalloc(cap, GFP_KERNEL);
+    u64 *next_seq = kcalloc(SCULL_STRESS_MAX_THREADS, sizeof(*next_seq), GFP_KERNEL);
+    u64 offset = 0;
+    ssize_t ret = 0;
+
+    if (!buf || !next_seq) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    while (!READ_ONCE(st->stop)) {
+        ret = scull_test_read(w->filp, buf, cap);
+        if (ret == -ERESTARTSYS) {
+            flush_signals(current);
+            ret = 0;
+            continue;
+        }
+        if (ret <= 0) {
+            scull_stress_fail(st, "read", -ret, 0);
+            break;
+        }
+        scull_stress_verify(st, buf, ret, next_seq, &offset);
+    }
+
+out:
+    kfree(next_seq);
+    kfree(buf);
+    return ret < 0 ? ret : 0;
+}
+
+static int scull_stress_init(struct kunit *test)
+{
+    return scull_test_create(test, SCULL_STRESS_SIZE);
+}
+
+static void scull_stress_run(struct kunit *test, bool report)
+{
+    const struct scull_stress_param *p = test->param_value;
+    struct scull_ring_buffer *dev = test->priv;
+    struct scull_test_thread *prod, *cons;
+    struct scull_stress_worker *workers;
+    struct scull_stress *st;
+    unsigned long deadline;
+    u64 start, elapsed, total, expect;
+    int i;
+
+    KUNIT_ASSERT_LE(test, p->producers, SCULL_STRESS_MAX_THREADS);
+    KUNIT_ASSERT_LE(test, p->consumers, SCULL_STRESS_MAX_THREADS);
+    // Под-кольцо должно вмещать хотя бы пару записей
+    if ((p->mode & SCULL_MODE_PERCPU) &&
+        SCULL_STRESS_SIZE / nr_cpu_ids < 2 * (p->msg_size + sizeof(struct scull_record_hdr)))
+        kunit_skip(test, "%u CPUs are too many for a %d byte buffer", nr_cpu_ids, SCULL_STRESS_SIZE);
+    KUNIT_ASSERT_EQ(test, scull_set_mode(dev, p->mode), 0);
+
+    st = kunit_kzalloc(test, sizeof(*st), GFP_KERNEL);
+    prod = kunit_kcalloc(test, p->producers, sizeof(*prod), GFP_KERNEL);
+    cons = kunit_kcalloc(test, p->consumers, sizeof(*cons), GFP_KERNEL);
+    workers = kunit_kcalloc(test, p->producers + p->consumers, sizeof(*workers), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, st);
+    KUNIT_ASSERT_NOT_NULL(test, prod);
+    KUNIT_ASSERT_NOT_NULL(test, cons);
+    KUNIT_ASSERT_NOT_NULL(test, workers);
+    st->p = p;
+    st->test = test;
+
+    start = ktime_get_ns();
+    for (i = 0; i < p->consumers; i++) {
+        workers[i] = (struct scull_stress_worker){ st, scull_test_file(test, 0), i };
+        KUNIT_ASSERT_EQ(test, scull_test_start(&cons[i], scull_stress_consumer, &workers[i],
+                                               "scull_cons", i), 0);
+    }
+    for (i = 0; i < p->producers; i++) {
+        struct scull_stress_worker *w = &workers[p->consumers + i];
+
+        *w = (struct scull_stress_worker){ st, scull_test_file(test, 0), i };
+        KUNIT_ASSERT_EQ(test, scull_test_start(&prod[i], scull_stress_producer, w,
+                                               "scull_prod", i), 0);
+    }
+
+    for (i = 0; i < p->producers; i++) {
+        KUNIT_EXPECT_TRUE(test, scull_test_join(&prod[i], SCULL_STRESS_TIMEOUT));
+        KUNIT_EXPECT_EQ(test, prod[i].ret, 0L);
+    }
+
+    // Писатели закончили: ждем, пока читатели заберут все, и будим их сигналом
+    total = atomic64_read(&st->written);
+    deadline = jiffies + SCULL_STRESS_TIMEOUT;
+    while (atomic64_read(&st->consumed) < total && time_before(jiffies, deadline))
+        msleep(1);
+    elapsed = ktime_get_ns() - start;
+    WRITE_ONCE(st->stop, true);
+    for (i = 0; i < p->consumers; i++) {
+        send_sig(SIGUSR1, cons[i].task, 1);
+        KUNIT_EXPECT_TRUE(test, scull_test_join(&cons[i], SCULL_TEST_TIMEOUT));
+        KUNIT_EXPECT_EQ(test, cons[i].ret, 0L);
+    }
+
+    KUNIT_EXPECT_EQ(test, atomic64_read(&st->consumed), total);
+    KUNIT_EXPECT_EQ(test, atomic_read(&st->failures), 0);
+    KUNIT_EXPECT_EQ(test, scull_data_size(dev), 0u);
+    KUNIT_EXPECT_EQ(test, READ_ONCE(dev->ctrl->read_waiters), 0u);
+    KUNIT_EXPECT_EQ(test, READ_ONCE(dev->ctrl->write_waiters), 0u);
+    if (p->mode & SCULL_MODE_RECORD) {
+        // Каждая запись прочитана ровно один раз: сумма seq = 0 + 1 + ... + ops - 1
+        expect = (u64)p->ops * (p->ops - 1) / 2;
+        for (i = 0; i < p->producers; i++)
+            KUNIT_EXPECT_EQ(test, atomic64_read(&st->seq_sum[i]), expect);
+    }
+
+    if (report) {
+        u64 bytes = SCULL_STAT_SUM(dev, read_bytes);
+
+        kunit_info(test, "%s: %llu MB/s, %llu writes/s, %llu reads/s, %llu read sleeps, %llu write sleeps\n",
+                   p->name, div64_u64(bytes * NSEC_PER_SEC, elapsed) >> 20,
+                   div64_u64(SCULL_STAT_SUM(dev, write_ops) * NSEC_PER_SEC, elapsed),
+                   div64_u64(SCULL_STAT_SUM(dev, read_ops) * NSEC_PER_SEC, elapsed),
+                   SCULL_STAT_SUM(dev, read_sleeps), SCULL_STAT_SUM(dev, write_sleeps));
+    }
+}
+
+static const struct scull_stress_param scull_stress_params[] = {
+    { "stream 1P/1C", 0, 1, 1, 20000, 512 },
+    { "records 4P/4C", SCULL_MODE_RECORD, 4, 4, 20000, 128 },
+    { "workqueue 4P/8C", SCULL_MODE_RECORD | SCULL_MODE_WORKQUEUE, 4, 8, 20000, 128 },
+    { "percpu 4P/2C", SCULL_MODE_RECORD | SCULL_MODE_PERCPU, 4, 2, 20000, 128 },
+};
+
+// Замеры: один писатель и один читатель, мелкие записи и крупные порции потока
+static const struct scull_stress_param scull_bench_params[] = {
+    { "stream 4K", 0, 1, 1, 50000, 4096 },
+    { "records 64B", SCULL_MODE_RECORD, 1, 1, 500000, 64 },
+    { "workqueue 64B 1P/4C", SCULL_MODE_RECORD | SCULL_MODE_WORKQUEUE, 1, 4, 200000, 64 },
+};
+
+static void scull_stress_desc(const struct scull_stress_param *p, char *desc)
+{
+    strscpy(desc, p->name, KUNIT_PARAM_DESC_SIZE);
+}
+
+KUNIT_ARRAY_PARAM(scull_stress, scull_stress_params, scull_stress_desc);
+KUNIT_ARRAY_PARAM(scull_bench, scull_bench_params, scull_stress_desc);
+
+static void scull_stress_test(struct kunit *test)
+{
+    scull_stress_run(test, false);
+}
+
+static void scull_bench_test(struct kunit *test)
+{
+    scull_stress_run(test, true);
+}
+
+static struct kunit_case scull_stress_cases[] = {
+    KUNIT_CASE_PARAM_SLOW(scull_stress_test, scull_stress_gen_params),
+    KUNIT_CASE_PARAM_SLOW(scull_bench_test, scull_bench_gen_params),
+    {}
+};
+
+static struct kunit_suite scull_stress_suite = {
+    .name = "scull_ring_buffer_stress",
+    .init = scull_stress_init,
+    .exit = scull_dev_test_exit,
+    .test_cases = scull_stress_cases,
+};
+
+kunit_test_suites(&scull_ring_suite, &scull_dev_suite, &scull_stress_suite);
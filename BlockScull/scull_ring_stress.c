@@ -0,0 +1,306 @@
+// scull_ring_stress - стресс-тест и микробенчмарк ядра кольца (scull_ring.h)
+// в user space, без загрузки модуля.
+//
+//   make stress && ./scull_ring_stress -p 4 -c 2 -r -t 5
+//   make stress-tsan && ./scull_ring_stress_tsan -p 2 -c 2 -s 1000
+//   make stress-asan && ./scull_ring_stress_asan -r -s 4096
+//
+// Писатели и читатели упорядочены мьютексами, как write_lock и read_lock в
+// драйвере, а между собой стороны общаются только через head/tail. Данные
+// проверяются на потерю, повтор и порядок:
+//  - в потоковом режиме байт со смещением n от начала потока равен
+//    stream_byte(n) - писатели под мьютексом продолжают общий поток;
+//  - в режиме записей каждая запись несет номер писателя и свой номер,
+//    а ее содержимое выводится из них; номера каждого писателя должны идти
+//    подряд.
+// По окончании печатается пропускная способность.
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scull_ring.h"
+
+#define MAX_THREADS 64
+
+// Заголовок данных записи, остаток записи - stream_byte(seq + i)
+struct stress_rec {
+    uint32_t producer;
+    uint32_t pad;
+    uint64_t seq;
+};
+
+// Позиции на разных строках кэша, как в struct scull_ring_ctrl
+struct stress_pos {
+    __u32 head __attribute__((aligned(SCULL_CACHELINE)));
+    __u32 tail __attribute__((aligned(SCULL_CACHELINE)));
+};
+
+static struct {
+    u32 ring_size;
+    size_t msg_size;       // Наибольший размер сообщения
+    bool fixed;            // Все сообщения размера msg_size
+    bool record;
+    int producers;
+    int consumers;
+    double duration;
+} cfg = {
+    .ring_size = 4096,
+    .msg_size = 256,
+    .producers = 1,
+    .consumers = 1,
+    .duration = 2.0,
+};
+
+static struct scull_ring ring;
+static struct stress_pos pos;
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t read_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Под write_lock / read_lock
+static uint64_t write_offset, read_offset;
+static uint64_t next_seq[MAX_THREADS];
+
+static atomic_bool stop;
+static atomic_int producers_left;
+static atomic_uint_fast64_t bytes_written, bytes_read, writes, reads, failures;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint8_t stream_byte(uint64_t n)
+{
+    return (uint8_t)(n ^ (n >> 8) ^ (n >> 16) ^ (n >> 24));
+}
+
+static inline uint64_t xorshift(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static void fail(const char *what, uint64_t a, uint64_t b)
+{
+    if (atomic_fetch_add(&failures, 1) < 10)
+        fprintf(stderr, "FAIL: %s (%" PRIu64 " vs %" PRIu64 ")\n", what, a, b);
+}
+
+static size_t pick_size(uint64_t *rnd, size_t min)
+{
+    if (cfg.fixed || cfg.msg_size <= min)
+        return cfg.msg_size;
+    return min + xorshift(rnd) % (cfg.msg_size - min + 1);
+}
+
+static void *producer_main(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    uint64_t rnd = 0x9e3779b97f4a7c15ull * (id + 1);
+    uint64_t seq = 0;
+    char *buf = malloc(cfg.msg_size);
+    size_t i, len;
+    ssize_t ret;
+
+    while (buf && !atomic_load_explicit(&stop, memory_order_relaxed)) {
+        len = pick_size(&rnd, cfg.record ? sizeof(struct stress_rec) : 1);
+
+        if (cfg.record) {
+            struct stress_rec rec = { .producer = id, .seq = seq };
+
+            memcpy(buf, &rec, sizeof(rec));
+            for (i = sizeof(rec); i < len; i++)
+                buf[i] = stream_byte(seq + i);
+        }
+
+        pthread_mutex_lock(&write_lock);
+        if (!cfg.record)
+            for (i = 0; i < len; i++)
+                buf[i] = stream_byte(write_offset + i);
+        ret = scull_ring_write(&ring, buf, len, cfg.record);
+        if (ret > 0)
+            write_offset += ret;
+        pthread_mutex_unlock(&write_lock);
+
+        if (ret == -EAGAIN) {
+            sched_yield();
+            continue;
+        }
+        if (ret <= 0 || (cfg.record && (size_t)ret != len)) {
+            fail("write", ret, len);
+            break;
+        }
+        seq++;
+        atomic_fetch_add_explicit(&writes, 1, memory_order_relaxed);
+        // read(2) в режиме записей отдает данные вместе с заголовками
+        atomic_fetch_add_explicit(&bytes_written, ret + (cfg.record ? sizeof(struct scull_record_hdr) : 0),
+                                  memory_order_relaxed);
+    }
+
+    free(buf);
+    atomic_fetch_sub(&producers_left, 1);
+    return NULL;
+}
+
+// Проверка прочитанного под read_lock: порядок данных виден только здесь
+static void verify(const char *buf, size_t len)
+{
+    size_t off = 0, i;
+
+    if (!cfg.record) {
+        for (i = 0; i < len; i++)
+            if ((uint8_t)buf[i] != stream_byte(read_offset + i)) {
+                fail("stream byte at offset", read_offset + i, (uint8_t)buf[i]);
+                break;
+            }
+        read_offset += len;
+        return;
+    }
+
+    while (off < len) {
+        struct scull_record_hdr hdr;
+        struct stress_rec rec;
+
+        memcpy(&hdr, buf + off, sizeof(hdr));
+        off += sizeof(hdr);
+        if (hdr.len < sizeof(rec) || hdr.len > len - off) {
+            fail("record length", hdr.len, len - off);
+            return;
+        }
+        memcpy(&rec, buf + off, sizeof(rec));
+        if (rec.producer >= (uint32_t)cfg.producers) {
+            fail("record producer", rec.producer, cfg.producers);
+            return;
+        }
+        if (rec.seq != next_seq[rec.producer])
+            fail("record sequence", rec.seq, next_seq[rec.producer]);
+        next_seq[rec.producer] = rec.seq + 1;
+        for (i = sizeof(rec); i < hdr.len; i++)
+            if ((uint8_t)buf[off + i] != stream_byte(rec.seq + i)) {
+                fail("record byte", i, (uint8_t)buf[off + i]);
+                break;
+            }
+        off += hdr.len;
+    }
+}
+
+static void *consumer_main(void *arg)
+{
+    size_t cap = cfg.msg_size + sizeof(struct scull_record_hdr);
+    char *buf = malloc(cap);
+    ssize_t ret;
+    u32 need;
+
+    (void)arg;
+    while (buf) {
+        pthread_mutex_lock(&read_lock);
+        ret = scull_ring_read(&ring, buf, cap, cfg.record, &need);
+        if (ret > 0)
+            verify(buf, ret);
+        pthread_mutex_unlock(&read_lock);
+
+        if (ret < 0) {
+            fail("read", -ret, 0);
+            break;
+        }
+        if (ret == 0) {
+            // Писатели закончили, а кольцо пусто - все прочитано
+            if (atomic_load(&producers_left) == 0 && scull_ring_data_size(&ring) == 0)
+                break;
+            sched_yield();
+            continue;
+        }
+        atomic_fetch_add_explicit(&reads, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&bytes_read, ret, memory_order_relaxed);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-s ring_size] [-m msg_size] [-F] [-r] [-p producers] [-c consumers] [-t seconds]\n"
+            "  -F  fixed message size (default: random up to msg_size)\n"
+            "  -r  record mode (default: byte stream)\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t threads[2 * MAX_THREADS];
+    struct timespec run;
+    uint64_t start, elapsed;
+    char *buffer;
+    int opt, i, n = 0;
+
+    while ((opt = getopt(argc, argv, "s:m:Frp:c:t:h")) != -1) {
+        switch (opt) {
+        case 's': cfg.ring_size = strtoul(optarg, NULL, 0); break;
+        case 'm': cfg.msg_size = strtoul(optarg, NULL, 0); break;
+        case 'F': cfg.fixed = true; break;
+        case 'r': cfg.record = true; break;
+        case 'p': cfg.producers = atoi(optarg); break;
+        case 'c': cfg.consumers = atoi(optarg); break;
+        case 't': cfg.duration = atof(optarg); break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (cfg.ring_size < 2 || cfg.ring_size > (1u << 30) || cfg.msg_size < 1 ||
+        cfg.producers < 1 || cfg.producers > MAX_THREADS ||
+        cfg.consumers < 1 || cfg.consumers > MAX_THREADS || cfg.duration <= 0 ||
+        (cfg.record && (cfg.msg_size < sizeof(struct stress_rec) ||
+                        cfg.msg_size + sizeof(struct scull_record_hdr) > cfg.ring_size))) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    buffer = malloc(cfg.ring_size);
+    if (!buffer) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    scull_ring_init(&ring, buffer, cfg.ring_size, &pos.head, &pos.tail);
+    atomic_store(&producers_left, cfg.producers);
+
+    start = now_ns();
+    for (i = 0; i < cfg.producers; i++)
+        pthread_create(&threads[n++], NULL, producer_main, (void *)(intptr_t)i);
+    for (i = 0; i < cfg.consumers; i++)
+        pthread_create(&threads[n++], NULL, consumer_main, NULL);
+
+    run.tv_sec = (time_t)cfg.duration;
+    run.tv_nsec = (long)((cfg.duration - run.tv_sec) * 1e9);
+    nanosleep(&run, NULL);
+    atomic_store(&stop, true);
+
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+    elapsed = now_ns() - start;
+
+    if (atomic_load(&bytes_read) != atomic_load(&bytes_written))
+        fail("bytes read vs written", atomic_load(&bytes_read), atomic_load(&bytes_written));
+
+    printf("ring %u%s, %s, msg %s%zu, %dP/%dC: %.2f MB/s, %.0f writes/s, %.0f reads/s, %" PRIu64 " failures\n",
+           cfg.ring_size, ring.mask ? " (pow2)" : "", cfg.record ? "records" : "stream",
+           cfg.fixed ? "" : "<=", cfg.msg_size, cfg.producers, cfg.consumers,
+           atomic_load(&bytes_read) / (elapsed / 1e9) / 1e6,
+           atomic_load(&writes) / (elapsed / 1e9), atomic_load(&reads) / (elapsed / 1e9),
+           (uint64_t)atomic_load(&failures));
+
+    free(buffer);
+    return atomic_load(&failures) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,111 @@
+// Точки трассировки scull_ring_buffer. Пока к ним не подключены ftrace или perf,
+// каждая точка - это один невыполняемый static branch на горячем пути.
+//
+//   echo 1 > /sys/kernel/tracing/events/scull_ring_buffer/enable
+//   cat /sys/kernel/tracing/trace_pipe
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull_ring_buffer
+
+#if !defined(_SCULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Успешные чтение и запись: сколько байт передано и заполненность после операции
+DECLARE_EVENT_CLASS(scull_xfer,
+    TP_PROTO(unsigned int minor, size_t bytes, u32 fill, u32 size),
+    TP_ARGS(minor, bytes, fill, size),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(pid_t, pid)
+        __field(size_t, bytes)
+        __field(u32, fill)
+        __field(u32, size)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pid = current->pid;
+        __entry->bytes = bytes;
+        __entry->fill = fill;
+        __entry->size = size;
+    ),
+
+    TP_printk("minor=%u pid=%d bytes=%zu fill=%u/%u",
+              __entry->minor, __entry->pid, __entry->bytes,
+              __entry->fill, __entry->size)
+);
+
+DEFINE_EVENT(scull_xfer, scull_read,
+    TP_PROTO(unsigned int minor, size_t bytes, u32 fill, u32 size),
+    TP_ARGS(minor, bytes, fill, size));
+
+DEFINE_EVENT(scull_xfer, scull_write,
+    TP_PROTO(unsigned int minor, size_t bytes, u32 fill, u32 size),
+    TP_ARGS(minor, bytes, fill, size));
+
+// Процесс засыпает в ожидании данных (writer = 0) или места (writer = 1)
+// и просыпается после этого
+DECLARE_EVENT_CLASS(scull_wait,
+    TP_PROTO(unsigned int minor, bool writer, u32 fill),
+    TP_ARGS(minor, writer, fill),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(pid_t, pid)
+        __field(bool, writer)
+        __field(u32, fill)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pid = current->pid;
+        __entry->writer = writer;
+        __entry->fill = fill;
+    ),
+
+    TP_printk("minor=%u pid=%d %s fill=%u",
+              __entry->minor, __entry->pid,
+              __entry->writer ? "writer" : "reader", __entry->fill)
+);
+
+DEFINE_EVENT(scull_wait, scull_sleep,
+    TP_PROTO(unsigned int minor, bool writer, u32 fill),
+    TP_ARGS(minor, writer, fill));
+
+DEFINE_EVENT(scull_wait, scull_wake,
+    TP_PROTO(unsigned int minor, bool writer, u32 fill),
+    TP_ARGS(minor, writer, fill));
+
+TRACE_EVENT(scull_ioctl,
+    TP_PROTO(unsigned int minor, unsigned int cmd, long ret),
+    TP_ARGS(minor, cmd, ret),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(pid_t, pid)
+        __field(unsigned int, cmd)
+        __field(long, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pid = current->pid;
+        __entry->cmd = cmd;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("minor=%u pid=%d cmd=0x%x ret=%ld",
+              __entry->minor, __entry->pid, __entry->cmd, __entry->ret)
+);
+
+#endif // _SCULL_TRACE_H
+
+// Заголовок лежит рядом с модулем, а не в include/trace/events
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>